@@ -1 +1,2 @@
 cl /EHcs /Ox test.cpp opencv_core249.lib zlib.lib opencv_highgui249.lib IlmImf.lib libjasper.lib libpng.lib libtiff.lib libjpeg.lib user32.lib comctl32.lib Advapi32.lib Gdi32.lib
+cl /EHcs /Ox simd_test.cpp
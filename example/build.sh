@@ -1 +1,2 @@
-g++ -O3 -Wall -std=c++1y test.cpp -o app `pkg-config --cflags --libs opencv`
\ No newline at end of file
+g++ -O3 -Wall -std=c++1y test.cpp -o app `pkg-config --cflags --libs opencv`
+g++ -O3 -Wall -std=c++1y simd_test.cpp -o simd_test
\ No newline at end of file
@@ -0,0 +1,151 @@
+#include "../include/simd_kernel.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace procon;
+
+
+namespace {
+
+int failN = 0;
+
+
+char const * isa_name(simd::Isa isa)
+{
+    switch(isa){
+        case simd::Isa::avx512: return "avx512";
+        case simd::Isa::avx2:   return "avx2";
+        case simd::Isa::sse2:   return "sse2";
+        default:                return "scalar";
+    }
+}
+
+
+// 足す順番が違うので、総和は誤差を許して比べる
+bool near(double a, double b, double scale)
+{
+    return std::abs(a - b) <= 1e-5 * (1 + scale);
+}
+
+
+void check(bool b, simd::Isa isa, char const * kernel, std::size_t n, std::size_t offset)
+{
+    if(b)
+        return;
+
+    ++failN;
+    std::cout << "NG: " << isa_name(isa) << "::" << kernel
+              << " n=" << n << " offset=" << offset << std::endl;
+}
+
+
+/**
+ks (命令セットisa) のカーネルと、スカラーのカーネルの結果を比べます。
+offsetだけずらした位置から読むので、境界に揃っていない入力も試します。
+*/
+void test_kernels(simd::Kernels const & ks, std::size_t n, std::size_t offset, std::mt19937& rnd)
+{
+    std::uniform_real_distribution<float> dist(0, 255);
+    std::uniform_int_distribution<int> dist8(0, 255);
+
+    std::vector<float> buf(4 * (n + offset));
+    for(auto& e: buf)
+        e = dist(rnd);
+
+    std::vector<std::uint8_t> buf8(2 * (n + offset));
+    for(auto& e: buf8)
+        e = static_cast<std::uint8_t>(dist8(rnd));
+
+    float const * a = buf.data() + offset;
+    float const * b = a + (n + offset);
+    float const * c = b + (n + offset);
+    float const * d = c + (n + offset);
+    std::uint8_t const * a8 = buf8.data() + offset;
+    std::uint8_t const * b8 = a8 + (n + offset);
+
+    const double scale = 255.0 * n;
+
+    // sad
+    {
+        const double ref = simd::scalar::sad(a, b, n);
+        check(near(ks.sad(a, b, n), ref, scale), ks.isa, "sad", n, offset);
+
+        const int slot = simd::fixed_slot(n);
+        if(slot >= 0)
+            check(near(ks.sad_fixed[slot](a, b, n), ref, scale), ks.isa, "sad_fixed", n, offset);
+    }
+
+    // sad_count
+    for(float th : {0.0f, 16.0f, 128.0f, 256.0f}){
+        double refSum, sum;
+        const std::size_t refCnt = simd::scalar::sad_count(a, b, n, th, &refSum);
+        const std::size_t cnt = ks.sad_count(a, b, n, th, &sum);
+        check(cnt == refCnt && near(sum, refSum, scale), ks.isa, "sad_count", n, offset);
+    }
+
+    // fused_stats
+    {
+        double refSum1, refSum2, sum1, sum2;
+        simd::scalar::fused_stats(a, b, c, d, n, &refSum1, &refSum2);
+        ks.fused_stats(a, b, c, d, n, &sum1, &sum2);
+        check(near(sum1, refSum1, scale) && near(sum2, refSum2, scale), ks.isa, "fused_stats", n, offset);
+    }
+
+    // abs_dev, sq_dev (中心はdoubleのまま使われる)
+    for(double center : {0.0, 42.5 + 1e-9, 300.0}){
+        const double ref = simd::scalar::abs_dev(a, b, n, center);
+        check(near(ks.abs_dev(a, b, n, center), ref, scale + center * n), ks.isa, "abs_dev", n, offset);
+
+        const double refSq = simd::scalar::sq_dev(a, b, n, center);
+        check(near(ks.sq_dev(a, b, n, center), refSq, (255.0 + center) * (scale + center * n)), ks.isa, "sq_dev", n, offset);
+    }
+
+    // sad_u8 (整数なので一致しなければならない)
+    {
+        const std::uint64_t ref = simd::scalar::sad_u8(a8, b8, n);
+        check(ks.sad_u8(a8, b8, n) == ref, ks.isa, "sad_u8", n, offset);
+
+        const int slot = simd::fixed_slot(n);
+        if(slot >= 0)
+            check(ks.sad_u8_fixed[slot](a8, b8, n) == ref, ks.isa, "sad_u8_fixed", n, offset);
+    }
+}
+
+}
+
+
+int main()
+{
+    // ベクトル幅(4, 8, 16要素)の端数をすべて通るような長さと、固定長カーネルの長さ
+    std::vector<std::size_t> lens = {0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65,
+                                     95, 96, 97, 191, 192, 193, 383, 384, 385, 1000};
+    for(std::size_t n = 0; n <= 48; ++n)
+        if(std::find(lens.begin(), lens.end(), n) == lens.end())
+            lens.push_back(n);
+
+    std::mt19937 rnd(0);
+
+    // このCPUで使える命令セットから、スカラーまでを順に試す
+    const simd::Isa top = simd::detect_isa();
+    for(int i = static_cast<int>(top); i >= 0; --i){
+        const simd::Kernels ks = simd::kernels_for(static_cast<simd::Isa>(i));
+        std::cout << "isa: " << isa_name(ks.isa) << std::endl;
+
+        for(auto n: lens)
+            for(std::size_t offset: {0, 1, 3})
+                test_kernels(ks, n, offset, rnd);
+    }
+
+    if(failN != 0){
+        std::cout << failN << " failures" << std::endl;
+        return 1;
+    }
+
+    std::cout << "ok" << std::endl;
+    return 0;
+}
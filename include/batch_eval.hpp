@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+#include "../../utils/include/types.hpp"
+
+
+namespace procon { namespace guess {
+
+/**
+比較関数BinFuncが、次のようなバッチ評価用のメンバ関数を持つかどうか
+
+    void batch(ImageID const & anchor, ImageID const * cands, std::size_t n, Direction dir, double* out) const;
+
+batchは、各 i < n について out[i] = f(anchor, cands[i], dir) を格納します。
+*/
+template <typename BinFunc>
+struct has_batch
+{
+  private:
+    template <typename F>
+    static auto check(F const * f) -> decltype(
+        f->batch(std::declval<utils::ImageID const &>(), std::declval<utils::ImageID const *>(),
+                 std::declval<std::size_t>(), std::declval<utils::Direction>(), std::declval<double*>()),
+        std::true_type());
+
+    template <typename F>
+    static std::false_type check(...);
+
+  public:
+    static constexpr bool value = decltype(check<BinFunc>(nullptr))::value;
+};
+
+
+/**
+比較関数BinFuncが、境界の比較として対称であることを宣言しているかどうか
+
+    static constexpr bool symmetric = true;
+
+をメンバに持つBinFuncは、f(a, b, left) == f(b, a, right), f(a, b, up) == f(b, a, down) を満たすものとして扱います。
+CandidateIndexは、これがtrueのときだけ、rightとdownの組の評価からleftとupの組の値を求めます。
+*/
+template <typename BinFunc>
+struct is_symmetric
+{
+  private:
+    template <typename F>
+    static std::integral_constant<bool, F::symmetric> check(F const *);
+
+    template <typename F>
+    static std::false_type check(...);
+
+  public:
+    static constexpr bool value = decltype(check<BinFunc>(nullptr))::value;
+};
+
+
+namespace detail {
+
+template <typename BinFunc>
+void evaluate_batch(BinFunc const & f, utils::ImageID const & anchor, utils::ImageID const * cands, std::size_t n,
+                    utils::Direction dir, double* out, std::true_type)
+{
+    f.batch(anchor, cands, n, dir, out);
+}
+
+
+template <typename BinFunc>
+void evaluate_batch(BinFunc const & f, utils::ImageID const & anchor, utils::ImageID const * cands, std::size_t n,
+                    utils::Direction dir, double* out, std::false_type)
+{
+    for(std::size_t i = 0; i < n; ++i)
+        out[i] = f(anchor, cands[i], dir);
+}
+
+} // namespace detail
+
+
+/**
+各 i < n について out[i] = f(anchor, cands[i], dir) を格納します。
+fがbatch()を持っていればそれを使い、持っていなければ1つずつ呼び出します。
+*/
+template <typename BinFunc>
+void evaluate_batch(BinFunc const & f, utils::ImageID const & anchor, utils::ImageID const * cands, std::size_t n,
+                    utils::Direction dir, double* out)
+{
+    detail::evaluate_batch(f, anchor, cands, n, dir, out, std::integral_constant<bool, has_batch<BinFunc>::value>());
+}
+
+}}
@@ -4,16 +4,23 @@
 #include "../../utils/include/template.hpp"
 #include "../../utils/include/types.hpp"
 #include "../../utils/include/range.hpp"
-#include "../../utils/include/dwrite.hpp"
 #include "guess.hpp"
-
+#include "batch_eval.hpp"
+#include "parallel.hpp"
+#include "telemetry.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <memory>
 #include <vector>
-#include <set>
 #include <array>
 #include <deque>
-#include <deque>
+#include <future>
 #include <tuple>
-#include <thread>
+#include <type_traits>
+#include <unordered_map>
 
 namespace procon { namespace bfs_guess {
 
@@ -26,273 +33,733 @@ inline ImageID convToImageID(std::size_t i, std::size_t w)
 }
 
 
+/// 探索状態の中で画像片の序数を保持する型
+typedef std::uint16_t Tile;
+
+
+/// 使用済みの画像片を表すビットマスクmaskの、i番目のビットが立っているかどうか
+inline bool test_bit(Tile const * mask, std::size_t i)
+{
+    return ((mask[i / 16] >> (i % 16)) & 1) != 0;
+}
+
+
+inline void set_bit(Tile* mask, std::size_t i)
+{
+    mask[i / 16] = static_cast<Tile>(mask[i / 16] | (1u << (i % 16)));
+}
+
+
 /**
-T型のもつvalue()を評価し、その平均値と標準偏差を計算し、predの評価結果がtrueな要素をdstに入れます
-その際、srcは破壊します。
+3段階目で埋める1つの位置と、その横に隣接する、既に埋まっている位置です。
+位置はすべて盤面の行優先の添字で、上の隣接位置は cell - div_x です。
 */
-template <typename T, typename Pred>
-void refine(std::deque<T>&& src, std::deque<T>& dst, Pred pred)
+struct FillStep
+{
+    std::size_t cell;       // 埋める位置
+    std::size_t side;       // 横に隣接する位置
+    Direction dir;          // sideから見たcellの方向
+};
+
+
+/**
+探索状態が共有する、問題と比較関数の情報
+*/
+template <typename BinFunc>
+struct SearchContext
 {
-    double m = 0, v = 0;
-    for(auto& e: src){
-        const double vv = e.value();
-        m += vv;
-        v += vv * vv;
+    SearchContext(utils::Problem const & problem, BinFunc const & f)
+    : pb(&problem), pred(&f), divX(problem.div_x()), divY(problem.div_y()),
+      tileN(divX * divY), maskN((tileN + 15) / 16), fillN((divX - 1) * (divY - 1))
+    {
+        PROCON_ENFORCE(tileN < std::numeric_limits<Tile>::max(), "画像片が多すぎます");
+
+        // 列がcntLN列目にあるとき、各行を列の左側(列に近い方から)、列の右側の順に埋める
+        fillOrder.reserve(divX * fillN);
+        for(std::size_t cntLN = 0; cntLN < divX; ++cntLN)
+            for(std::size_t r = 1; r < divY; ++r){
+                for(std::size_t c = cntLN; c-- > 0;)
+                    fillOrder.push_back(FillStep{r * divX + c, r * divX + c + 1, Direction::left});
+
+                for(std::size_t c = cntLN + 1; c < divX; ++c)
+                    fillOrder.push_back(FillStep{r * divX + c, r * divX + c - 1, Direction::right});
+            }
     }
 
-    m /= src.size();
-    v = v / src.size() - m * m;
-    const double sd = std::sqrt(v);
 
-    for(auto& e: src)
-        if(pred(e.value(), m, sd))
-            dst.push_back(std::move(e));
-    src.clear();
+    ImageID id(std::size_t ord) const { return convToImageID(ord, divX); }
+
+
+    /// 列がcntLN列目にあるときの、3段階目で埋める位置の順序
+    FillStep const * fill_order(std::size_t cntLN) const { return fillOrder.data() + cntLN * fillN; }
+
+
+    utils::Problem const * pb;
+    BinFunc const * pred;
+    std::size_t divX;
+    std::size_t divY;
+    std::size_t tileN;
+    std::size_t maskN;      // ビットマスクの要素数
+    std::size_t fillN;      // 3段階目で埋める位置の数
+    std::vector<FillStep> fillOrder;
+};
+
+
+/**
+探索状態の中身(使用済みの画像片のビットマスクと、画像片の並び)を格納する領域です。
+
+すべてのブロックは同じ大きさで、まとめて確保したチャンクから切り出すので、
+ブロックのアドレスはclear()するまで変わりません。
+clear()はチャンクを残したまま全体を空にするので、世代ごとに使い回せばメモリの確保は起きません。
+*/
+class StateArena
+{
+  public:
+    explicit StateArena(std::size_t blockSize) : _blockSize(blockSize), _chunk(0), _used(0) {}
+
+
+    std::size_t blockSize() const { return _blockSize; }
+
+
+    Tile* allocate()
+    {
+        if(_used == chunkBlocks){
+            ++_chunk;
+            _used = 0;
+        }
+
+        if(_chunk == _chunks.size())
+            _chunks.emplace_back(new Tile[chunkBlocks * _blockSize]);
+
+        return _chunks[_chunk].get() + (_used++) * _blockSize;
+    }
+
+
+    void clear()
+    {
+        _chunk = 0;
+        _used = 0;
+    }
+
+
+  private:
+    static constexpr std::size_t chunkBlocks = 256;
+
+    std::size_t _blockSize;
+    std::size_t _chunk;         // 現在切り出しているチャンク
+    std::size_t _used;          // 現在のチャンクから切り出したブロック数
+    std::vector<std::unique_ptr<Tile[]>> _chunks;
+};
+
+
+/**
+子の状態の記録です。
+親の状態の番号、置く画像片、置く方向、子の評価値とハッシュ値だけを持ち、
+ビームに残ったものだけを、親のchild()で実際の状態にします。
+*/
+struct Child
+{
+    std::size_t parent;     // 親の状態の、世代の中での番号
+    Tile tile;
+    Direction dir;
+    double value;           // 子の評価値
+    std::uint64_t hash;     // 子のハッシュ値
+};
+
+
+/**
+状態のハッシュ値を作るための鍵の種類
+*/
+enum class ZobristKind : std::uint64_t
+{
+    columnTile,     // 1段階目の列に含まれる画像片
+    vertical,       // 1段階目の列で、上下に隣接する画像片の組
+    rowTile,        // 2段階目の行に含まれる画像片
+    horizontal,     // 2段階目の行で、左右に隣接する画像片の組
+    cell,           // 3段階目で、盤面のある位置に置いた画像片
+};
+
+
+/**
+(kind, a, b)に対するZobristハッシュの鍵を返します。
+状態のハッシュ値は、その状態を構成する要素の鍵の排他的論理和です。
+鍵は表を持たずに、splitmix64の混ぜ合わせで作ります。
+*/
+inline std::uint64_t zobrist_key(ZobristKind kind, std::size_t a, std::size_t b)
+{
+    std::uint64_t z = (static_cast<std::uint64_t>(kind) << 58)
+                    ^ (static_cast<std::uint64_t>(a) << 29)
+                    ^ static_cast<std::uint64_t>(b);
+
+    z += 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
 }
 
 
+/**
+残っている画像片を一括で評価するための、スレッドごとの作業領域
+*/
+struct RemainBatch
+{
+    std::vector<std::size_t> ords;      // 残っている画像片の序数
+    std::vector<ImageID> ids;           // 残っている画像片
+    std::vector<double> vals[2];        // 評価値
+    std::size_t evaluated;              // このスレッドで比較関数を呼び出した回数
+
+
+    RemainBatch() : evaluated(0) {}
+
+
+    /// ビットマスクmaskが立っていない画像片を集めます
+    void collect(Tile const * mask, std::size_t tileN, std::size_t w)
+    {
+        ords.clear();
+        ids.clear();
+        for(std::size_t i = 0; i < tileN; ++i)
+            if(!test_bit(mask, i)){
+                ords.push_back(i);
+                ids.push_back(convToImageID(i, w));
+            }
+    }
+
+
+    /// 集めた画像片を、画像片anchorのdir方向に対して評価し、vals[k]に格納します
+    template <typename BinFunc>
+    void evaluate(std::size_t k, BinFunc const & f, ImageID const & anchor, Direction dir)
+    {
+        vals[k].resize(ids.size());
+        guess::evaluate_batch(f, anchor, ids.data(), ids.size(), dir, vals[k].data());
+        evaluated += ids.size();
+    }
+
+
+    static RemainBatch& instance()
+    {
+        thread_local RemainBatch b;
+        return b;
+    }
+};
+
+
+/**
+bfs_guessとbfs_guess_parallelの設定
+*/
+struct SearchConfig
+{
+    SearchConfig() : beamWidth(0), timeBudget(std::chrono::milliseconds::zero()), memoryCap(0), pTelemetry(nullptr) {}
+
+
+    std::size_t beamWidth;                  // ビームの幅。0のときはそれぞれの関数の既定値
+    std::chrono::milliseconds timeBudget;   // 探索にかけてよい時間。0のときは無制限
+    std::size_t memoryCap;                  // 探索状態に使ってよいメモリのバイト数。0のときは無制限
+    telemetry::Telemetry* pTelemetry;       // nullptrでなければ、Stage1, 2, 3の記録を追加する
+};
+
+
+/**
+探索の締め切り
+*/
+class Deadline
+{
+  public:
+    /// 締め切りなし
+    Deadline() : _unlimited(true) {}
+
+
+    /// 今からbudget後が締め切り。budgetが0のときは締め切りなし
+    explicit Deadline(std::chrono::milliseconds budget)
+    : _unlimited(budget == std::chrono::milliseconds::zero()),
+      _at(std::chrono::steady_clock::now() + budget) {}
+
+
+    bool expired() const
+    {
+        return !_unlimited && std::chrono::steady_clock::now() >= _at;
+    }
+
+
+  private:
+    bool _unlimited;
+    std::chrono::steady_clock::time_point _at;
+};
+
+
+/**
+評価値の小さい子を最大capacity個まで保持する、ハッシュ値で引ける最大ヒープです。
+
+根には保持している中で最悪の子があり、それより良い子が来たときだけ入れ替えます。
+各子のヒープ内の位置をハッシュ値から引けるので、同じ状態の子が来たときも、
+探し出して置き換えるのはO(log capacity)で済みます。
+*/
+class BeamHeap
+{
+  public:
+    /// 空にして、保持する子の最大数をcapacityにします
+    void reset(std::size_t capacity)
+    {
+        _capacity = std::max<std::size_t>(capacity, 1);
+        _heap.clear();
+        _slot.clear();
+        _slot.reserve(_capacity * 2);
+    }
+
+
+    /**
+    子cを加えます。
+    同じハッシュ値の子が既にあれば評価値が小さい方を残し、trueを返します。
+    */
+    bool push(Child const & c)
+    {
+        auto it = _slot.find(c.hash);
+        if(it != _slot.end()){
+            const std::size_t i = it->second;
+            if(c.value < _heap[i].value){
+                _heap[i] = c;
+                sift_down(i);
+            }
+            return true;
+        }
+
+        if(_heap.size() < _capacity){
+            _heap.push_back(c);
+            _slot[c.hash] = _heap.size() - 1;
+            sift_up(_heap.size() - 1);
+        }else if(c.value < _heap[0].value){     // 最悪の子と入れ替える
+            _slot.erase(_heap[0].hash);
+            _heap[0] = c;
+            _slot[c.hash] = 0;
+            sift_down(0);
+        }
+
+        return false;
+    }
+
+
+    std::size_t size() const { return _heap.size(); }
+
+
+    /**
+    保持している子を評価値の小さい順に並べて返します。
+    この後は、reset()するまでpush()できません。
+    */
+    std::vector<Child>& sorted()
+    {
+        std::sort(_heap.begin(), _heap.end(), [](Child const & a, Child const & b){ return a.value < b.value; });
+        _slot.clear();
+        return _heap;
+    }
+
+
+  private:
+    std::size_t _capacity = 1;
+    std::vector<Child> _heap;                                   // 評価値の最大ヒープ
+    std::unordered_map<std::uint64_t, std::size_t> _slot;       // ハッシュ値 -> _heapの中の位置
+
+
+    void move_to(std::size_t i, Child const & c)
+    {
+        _heap[i] = c;
+        _slot[c.hash] = i;
+    }
+
+
+    void sift_up(std::size_t i)
+    {
+        const Child c = _heap[i];
+        while(i > 0){
+            const std::size_t parent = (i - 1) / 2;
+            if(!(_heap[parent].value < c.value))
+                break;
+
+            move_to(i, _heap[parent]);
+            i = parent;
+        }
+        move_to(i, c);
+    }
+
+
+    void sift_down(std::size_t i)
+    {
+        const Child c = _heap[i];
+        const std::size_t n = _heap.size();
+        while(2 * i + 1 < n){
+            std::size_t larger = 2 * i + 1;
+            if(larger + 1 < n && _heap[larger].value < _heap[larger + 1].value)
+                ++larger;
+
+            if(!(c.value < _heap[larger].value))
+                break;
+
+            move_to(i, _heap[larger]);
+            i = larger;
+        }
+        move_to(i, c);
+    }
+};
 
+
+/**
+幅maxSizeのビームサーチを、stateの状態が終端に達するまで行います。
+
+各世代では、すべての親の子の中から、評価値が小さいものを最大maxSize個だけ残します。
+子はまず記録(Child)として列挙し、大きさmaxSizeのBeamHeapで選別して、
+残った記録だけを実際の状態にします。
+ハッシュ値が同じ子は同じ状態とみなし、評価値が最も小さいものだけをビームに残します。
+終了時、stateは評価値の小さい順に並んでいます。
+
+stateの中身はarenaに格納されている必要があります。
+子はspareに作り、世代が終わるたびにarenaを空にしてspareと入れ替えるので、
+終了時もstateの中身はarenaにあり、spareは空です。
+
+deadlineを過ぎると、その時点までに得られた最良の状態だけを残し、
+以降は幅1、つまり貪欲法で終端まで進めます。
+
+pTelemetryがnullptrでなければ、探索の計数値を最後にまとめてその現在の段階に加えます。
+*/
 template <typename State>
-void bfs_guess_impl(std::deque<State>& state, std::size_t maxSize)
+void bfs_guess_impl(std::deque<State>& state, std::size_t maxSize, StateArena& arena, StateArena& spare,
+                    Deadline const & deadline = Deadline(), telemetry::Telemetry* pTelemetry = nullptr)
 {
-    std::size_t iterCount = 0;
+    telemetry::Counters stats;
+    const std::size_t evaluated0 = RemainBatch::instance().evaluated;
+
+    maxSize = std::max<std::size_t>(maxSize, 1);
+
+    BeamHeap heap;
+    std::vector<Child> children;
     while(!state.empty() && !state[0].isEnd()){
-        std::deque<State> dst1;
-        for(auto& e: state){
-            e.update(dst1);
-
-            std::deque<State> dst2;
-            refine(std::move(dst1), dst2, [](double v, double m, double sd){ return v <= m + sd; });
-            dst1 = [](){ std::deque<State> ini; return ini; }();
-
-            std::set<State> rbtree;
-            for(auto& e: dst2)
-                rbtree.insert(std::move(e));
-
-            for(auto& e: rbtree){
-                dst1.push_back(std::move(e));
-                if(dst1.size() >= maxSize)
-                    break;
+        if(maxSize > 1 && deadline.expired()){     // 最良の状態だけを残して、すぐに貪欲法に切り替える
+            maxSize = 1;
+            state.erase(state.begin() + 1, state.end());
+        }
+
+        heap.reset(maxSize);
+        const std::size_t generated0 = stats.generated;
+        const std::size_t duplicates0 = stats.duplicates;
+        for(std::size_t p = 0; p < state.size(); ++p){
+            if(p != 0 && maxSize > 1 && deadline.expired()){     // 残りの親は展開しない
+                maxSize = 1;
+                break;
             }
+
+            children.clear();
+            state[p].expand(p, children);
+            ++stats.expanded;
+            stats.generated += children.size();
+
+            for(auto& c: children)
+                if(heap.push(c))                    // 同じ状態が既にビームにあった
+                    ++stats.duplicates;
         }
 
-        state = std::move(dst1);
+        auto& beam = heap.sorted();
+        if(beam.size() > maxSize)
+            beam.resize(maxSize);
+
+        std::deque<State> next;
+        for(auto& c: beam)
+            next.push_back(state[c.parent].child(c, spare));
+
+        state = std::move(next);
+
+        arena.clear();
+        std::swap(arena, spare);
+
+        ++stats.generations;
+        stats.pruned += (stats.generated - generated0) - (stats.duplicates - duplicates0) - beam.size();
+        stats.maxBeam = std::max(stats.maxBeam, beam.size());
+    }
+
+    if(pTelemetry){
+        stats.comparisons = RemainBatch::instance().evaluated - evaluated0;
+        if(!state.empty())
+            stats.best = state[0].value();
+
+        pTelemetry->add(stats);
     }
 }
 
 
+/**
+1段階目の状態。1列の画像片の並びを、上下に伸ばしていきます。
 
+ブロックには、ビットマスクの後に、長さ2*div_y-1の列が続きます。
+列の中央から始めて、上にも下にもdiv_y-1個まで伸ばせます。
+状態のコピーはブロックを共有するので、子の状態はchild()で作ります。
+*/
 template <typename BinFunc>
 struct State1st
 {
-    State1st(utils::Problem const *pb, BinFunc const *func, std::deque<ImageID> const & idx, std::vector<bool> const & rem, double ev)
-    : _pb(pb), _pred(func), _idx(idx), _remain(rem), _ev(ev) {}
+    typedef BinFunc BinFuncType;
+    typedef SearchContext<BinFunc> Context;
+
+
+    static std::size_t block_size(Context const & ctx) { return ctx.maskN + ctx.divY * 2 - 1; }
 
 
-    double value() const
+    /// 画像片originだけからなる状態を、arenaに作ります
+    State1st(Context const * ctx, StateArena& arena, std::size_t origin)
+    : _ctx(ctx), _data(arena.allocate()), _ev(0), _hash(zobrist_key(ZobristKind::columnTile, origin, 0)),
+      _head(ctx->divY - 1), _tail(ctx->divY)
     {
-        return _ev;
+        std::fill(_data, _data + ctx->maskN, Tile(0));
+        set_bit(_data, origin);
+        _data[ctx->maskN + _head] = static_cast<Tile>(origin);
     }
 
 
-    std::deque<ImageID> const & index() const
+    double value() const { return _ev; }
+
+
+    /// 列の長さ
+    std::size_t size() const { return _tail - _head; }
+
+
+    /// 列の上からi番目の画像片
+    Tile at(std::size_t i) const { return _data[_ctx->maskN + _head + i]; }
+
+
+    bool operator==(State1st<BinFunc> const & rhs) const
     {
-        return _idx;
+        return size() == rhs.size()
+            && std::equal(_data + _ctx->maskN + _head, _data + _ctx->maskN + _tail, rhs._data + _ctx->maskN + rhs._head);
     }
 
 
-    bool operator==(State1st<BinFunc> const & rhs) const
-    { return utils::equal(index(), rhs.index()); }
     bool operator!=(State1st<BinFunc> const & rhs) const
     { return !(*(this) == rhs); }
     bool operator<(State1st<BinFunc> const & rhs) const
     { return this->value() < rhs.value(); }
 
 
-    bool isEnd() const { return _idx.size() == _pb->div_y(); }
+    bool isEnd() const { return size() == _ctx->divY; }
 
 
-    void update(std::deque<State1st> & q)
+    /// この状態(世代の中での番号がself)の子の記録をdstに加えます
+    void expand(std::size_t self, std::vector<Child>& dst) const
     {
-        std::size_t i = 0;
-        for(bool e: _remain){
-            if(e){
-                State1st<BinFunc> dupTop = *this;
-                dupTop.insert(Direction::up, i);
-                q.push_back(std::move(dupTop));
-
-                State1st<BinFunc> dupBottom = *this;
-                dupBottom.insert(Direction::down, i);
-                q.push_back(std::move(dupBottom));
-            }
-            ++i;
+        auto& b = RemainBatch::instance();
+        b.collect(_data, _ctx->tileN, _ctx->divX);
+        b.evaluate(0, *_ctx->pred, _ctx->id(at(0)), Direction::up);
+        b.evaluate(1, *_ctx->pred, _ctx->id(at(size()-1)), Direction::down);
+
+        for(std::size_t j = 0; j < b.ords.size(); ++j){
+            const Tile t = static_cast<Tile>(b.ords[j]);
+            const std::uint64_t h = _hash ^ zobrist_key(ZobristKind::columnTile, t, 0);
+            dst.push_back(Child{self, t, Direction::up, _ev + std::abs(b.vals[0][j]),
+                                h ^ zobrist_key(ZobristKind::vertical, t, at(0))});
+            dst.push_back(Child{self, t, Direction::down, _ev + std::abs(b.vals[1][j]),
+                                h ^ zobrist_key(ZobristKind::vertical, at(size()-1), t)});
         }
     }
 
 
-    Problem const *_pb;
-    BinFunc const *_pred;
-    std::deque<ImageID> _idx;
-    std::vector<bool> _remain;
-    double _ev;
-
-
-    double pred_value(Direction dir, ImageID const & index)
+    /// 記録cの子を、arenaに作ります
+    State1st child(Child const & c, StateArena& arena) const
     {
-        ImageID tI;
-        if(dir == Direction::up)
-            tI = _idx[0];
-        else
-            tI = _idx[_idx.size()-1];
+        State1st dst = *this;
+        dst._data = arena.allocate();
+        std::copy(_data, _data + block_size(*_ctx), dst._data);
 
-        return std::abs((*_pred)(tI,
-                        index,
-                        dir));
+        dst._ev = c.value;
+        dst._hash = c.hash;
+        dst.place(c.dir, c.tile);
+        return dst;
     }
 
 
-    void insert(Direction dir, std::size_t i)
+    /// 画像片iを、dir方向の端に加えます
+    void place(Direction dir, std::size_t i)
     {
-        const ImageID index = convToImageID(i, _pb->div_x());
-
-        _ev += pred_value(dir, index);
-
         if(dir == Direction::up)
-            _idx.push_front(index);
+            _data[_ctx->maskN + --_head] = static_cast<Tile>(i);
         else
-            _idx.push_back(index);
+            _data[_ctx->maskN + _tail++] = static_cast<Tile>(i);
 
-        _remain[i] = false;
+        set_bit(_data, i);
     }
+
+
+    Context const * _ctx;
+    Tile* _data;
+    double _ev;
+    std::uint64_t _hash;    // 列の画像片と、上下に隣接する組の鍵の排他的論理和
+    std::size_t _head;      // 列の先頭の位置
+    std::size_t _tail;      // 列の末尾の次の位置
 };
 
 
+/**
+2段階目の状態。1段階目で決めた列の一番上の画像片から、1行目を左右に伸ばしていきます。
+
+ブロックには、ビットマスクの後に、長さdiv_yの列と、長さ2*div_x-1の行が続きます。
+*/
 template <typename BinFunc>
 struct State2nd
 {
-    explicit State2nd(State1st<BinFunc>&& state)
-    : _1st(state), _idx({state.index()[0]}), _cntLN(0) {}
+    typedef BinFunc BinFuncType;
+    typedef SearchContext<BinFunc> Context;
 
 
-    double value() const { return _1st.value(); }
+    static std::size_t block_size(Context const & ctx) { return ctx.maskN + ctx.divY + ctx.divX * 2 - 1; }
 
 
-    bool operator==(State2nd<BinFunc> const & rhs) const
+    State2nd(State1st<BinFunc> const & state, StateArena& arena)
+    : _ctx(state._ctx), _data(arena.allocate()), _ev(state._ev),
+      _hash(state._hash ^ zobrist_key(ZobristKind::rowTile, state.at(0), 0)),
+      _head(_ctx->divX - 1), _tail(_ctx->divX), _cntLN(0)
     {
-        return _1st == rhs._1st && utils::equal(_idx, rhs._idx);
+        std::copy(state._data, state._data + _ctx->maskN, _data);
+        for(std::size_t r = 0; r < _ctx->divY; ++r)
+            _data[_ctx->maskN + r] = state.at(r);
+
+        row()[_head] = state.at(0);
     }
 
 
-    bool operator!=(State2nd<BinFunc> const & rhs) const
-    {
-        return !(*this == rhs);
-    }
+    double value() const { return _ev; }
 
-    bool operator<(State2nd<BinFunc> const & rhs) const
-    { return this->value() < rhs.value(); }
+
+    /// 1段階目で決めた列の、上からr番目の画像片
+    Tile col(std::size_t r) const { return _data[_ctx->maskN + r]; }
 
 
-    bool isEnd() const { return _idx.size() == _1st._pb->div_x(); }
+    /// 行の長さ
+    std::size_t size() const { return _tail - _head; }
 
 
-    void update(std::deque<State2nd>& dst)
+    /// 行の左からi番目の画像片
+    Tile at(std::size_t i) const { return row()[_head + i]; }
+
+
+    bool operator==(State2nd<BinFunc> const & rhs) const
     {
-        std::size_t i = 0;
-        for(bool e: _1st._remain){
-            if(e){
-                auto dupLeft = *this;
-                dupLeft.insert(Direction::left, i);
-                dst.push_back(std::move(dupLeft));
-
-                auto dupRight = *this;
-                dupRight.insert(Direction::right, i);
-                dst.push_back(std::move(dupRight));
-            }
-            ++i;
-        }
+        return size() == rhs.size()
+            && std::equal(_data + _ctx->maskN, _data + _ctx->maskN + _ctx->divY, rhs._data + _ctx->maskN)
+            && std::equal(row() + _head, row() + _tail, rhs.row() + rhs._head);
     }
 
 
-    std::deque<ImageID> const & index2nd()
+    bool operator!=(State2nd<BinFunc> const & rhs) const
     {
-        return _idx;
+        return !(*this == rhs);
     }
 
+    bool operator<(State2nd<BinFunc> const & rhs) const
+    { return this->value() < rhs.value(); }
+
+
+    bool isEnd() const { return size() == _ctx->divX; }
+
 
-    std::deque<ImageID> const & index1st()
+    void expand(std::size_t self, std::vector<Child>& dst) const
     {
-        return _1st.index();
+        auto& b = RemainBatch::instance();
+        b.collect(_data, _ctx->tileN, _ctx->divX);
+        b.evaluate(0, *_ctx->pred, _ctx->id(at(0)), Direction::left);
+        b.evaluate(1, *_ctx->pred, _ctx->id(at(size() - 1)), Direction::right);
+
+        for(std::size_t j = 0; j < b.ords.size(); ++j){
+            const Tile t = static_cast<Tile>(b.ords[j]);
+            const std::uint64_t h = _hash ^ zobrist_key(ZobristKind::rowTile, t, 0);
+            dst.push_back(Child{self, t, Direction::left, _ev + std::abs(b.vals[0][j]),
+                                h ^ zobrist_key(ZobristKind::horizontal, t, at(0))});
+            dst.push_back(Child{self, t, Direction::right, _ev + std::abs(b.vals[1][j]),
+                                h ^ zobrist_key(ZobristKind::horizontal, at(size() - 1), t)});
+        }
     }
 
 
     std::size_t insertLeftCount() const { return _cntLN; }
 
 
-    State1st<BinFunc> _1st;
-    std::deque<ImageID> _idx;
-    std::size_t _cntLN;
-
-
-    double pred_value(Direction dir, ImageID const & index)
+    State2nd child(Child const & c, StateArena& arena) const
     {
-        auto tI = _idx[0];
-        if(dir == Direction::right)
-            tI = _idx[_idx.size() - 1];
+        State2nd dst = *this;
+        dst._data = arena.allocate();
+        std::copy(_data, _data + block_size(*_ctx), dst._data);
 
-        return std::abs((*_1st._pred)(tI,
-                                      index,
-                                      dir));
+        dst._ev = c.value;
+        dst._hash = c.hash;
+        dst.place(c.dir, c.tile);
+        return dst;
     }
 
 
-    void insert(Direction dir, std::size_t i)
+    /// 画像片iを、dir方向の端に加えます
+    void place(Direction dir, std::size_t i)
     {
-        const ImageID index = convToImageID(i, _1st._pb->div_x());
-
-        _1st._ev += pred_value(dir, index);
-
         if(dir == Direction::left){
-            _idx.push_front(index);
+            row()[--_head] = static_cast<Tile>(i);
             ++_cntLN;
         }
         else
-            _idx.push_back(index);
+            row()[_tail++] = static_cast<Tile>(i);
 
-        _1st._remain[i] = false;
+        set_bit(_data, i);
     }
+
+
+    Context const * _ctx;
+    Tile* _data;
+    double _ev;
+    std::uint64_t _hash;    // 列のハッシュ値に、行の画像片と、左右に隣接する組の鍵を加えたもの
+    std::size_t _head;
+    std::size_t _tail;
+    std::size_t _cntLN;
+
+
+    Tile* row() const { return _data + _ctx->maskN + _ctx->divY; }
 };
 
 
+/**
+3段階目の状態。1行目と、1段階目で決めた列を元に、残りの位置を1行ずつ埋めていきます。
+
+ブロックには、ビットマスクの後に、div_y * div_xの盤面が行優先で続きます。
+まだ埋まっていない位置にはemptyTileが入っています。
+埋める位置の順序と隣接する位置は、SearchContext::fill_order()の表を引くだけで求まります。
+*/
 template <typename BinFunc>
 struct State3rd
 {
-    explicit State3rd(State2nd<BinFunc>&& state)
-    : _1st(state._1st), _idx({state._idx}), _cntLN(state._cntLN), _ctIdx(0) {
-        for(auto i: utils::iota(static_cast<size_t>(1), _1st._pb->div_y()))
-            _idx.push_back({_1st.index()[i]});
-    }
+    typedef BinFunc BinFuncType;
+    typedef SearchContext<BinFunc> Context;
+
+    static constexpr Tile emptyTile = std::numeric_limits<Tile>::max();
 
 
-    double value() const { return _1st.value(); }
+    static std::size_t block_size(Context const & ctx) { return ctx.maskN + ctx.divY * ctx.divX; }
 
 
-    bool operator==(State3rd<BinFunc> const & rhs)
+    State3rd(State2nd<BinFunc> const & state, StateArena& arena)
+    : _ctx(state._ctx), _data(arena.allocate()), _ev(state._ev), _hash(state._hash),
+      _cntLN(state._cntLN), _ctIdx(0), _fill(state._ctx->fill_order(state._cntLN))
     {
-        if(_cntLN != rhs._cntLN)
-            return false;
+        std::copy(state._data, state._data + _ctx->maskN, _data);
+        std::fill(grid(), grid() + _ctx->divY * _ctx->divX, static_cast<Tile>(emptyTile));
+
+        for(std::size_t c = 0; c < _ctx->divX; ++c)
+            grid()[c] = state.at(c);
+
+        for(std::size_t r = 1; r < _ctx->divY; ++r)
+            grid()[r * _ctx->divX + _cntLN] = state.col(r);
+    }
 
-        if(_idx.size() != rhs._idx.size())
-            return false;
 
-        for(auto i: utils::iota(_idx.size()))
-            if(!utils::equal(_idx[i], rhs._idx[i]))
-                return false;
+    double value() const { return _ev; }
 
-        return true;
+
+    bool operator==(State3rd<BinFunc> const & rhs) const
+    {
+        return _cntLN == rhs._cntLN
+            && std::equal(grid(), grid() + _ctx->divY * _ctx->divX, rhs.grid());
     }
 
 
-    bool operator!=(State3rd<BinFunc> const & rhs)
+    bool operator!=(State3rd<BinFunc> const & rhs) const
     {
         return !(*this == rhs);
     }
@@ -301,206 +768,269 @@ struct State3rd
     { return this->value() < rhs.value(); }
 
 
-    std::vector<std::deque<ImageID>> const & index() const { return _idx; }
+    std::vector<std::vector<ImageID>> index() const
+    {
+        std::vector<std::vector<ImageID>> dst(_ctx->divY);
+        for(std::size_t r = 0; r < _ctx->divY; ++r)
+            for(std::size_t c = 0; c < _ctx->divX; ++c)
+                dst[r].push_back(_ctx->id(grid()[r * _ctx->divX + c]));
+
+        return dst;
+    }
 
 
-    void update(std::deque<State3rd<BinFunc>>& dst)
+    /// 子の評価値は、親の評価値に横、縦の順で増分を足したものです
+    void expand(std::size_t self, std::vector<Child>& dst) const
     {
-        std::size_t i = 0;
-        for(bool e: _1st._remain){
-            if(e){
-                State3rd<BinFunc> dup = *this;
-                dup.insert(i);
-                dst.push_back(std::move(dup));
-            }
-            ++i;
+        ImageID tIh, tIv;
+        Direction dir;
+        neighbors(&tIh, &tIv, &dir);
+
+        auto& b = RemainBatch::instance();
+        b.collect(_data, _ctx->tileN, _ctx->divX);
+        b.evaluate(0, *_ctx->pred, tIh, dir);
+        b.evaluate(1, *_ctx->pred, tIv, Direction::down);
+
+        const std::size_t cell = _fill[_ctIdx].cell;
+        for(std::size_t j = 0; j < b.ords.size(); ++j){
+            double v = _ev;
+            v += std::abs(b.vals[0][j]);
+            v += std::abs(b.vals[1][j]);
+            dst.push_back(Child{self, static_cast<Tile>(b.ords[j]), dir, v,
+                                _hash ^ zobrist_key(ZobristKind::cell, cell, b.ords[j])});
         }
     }
 
 
+    State3rd child(Child const & c, StateArena& arena) const
+    {
+        State3rd dst = *this;
+        dst._data = arena.allocate();
+        std::copy(_data, _data + block_size(*_ctx), dst._data);
+
+        dst._ev = c.value;
+        dst._hash = c.hash;
+        dst.place(c.tile);
+        return dst;
+    }
+
+
     bool isEnd() const {
-        return _ctIdx == (_1st._pb->div_x() - 1) * (_1st._pb->div_y() - 1);
+        return _ctIdx == _ctx->fillN;
     }
 
 
-    State1st<BinFunc> _1st;
-    std::vector<std::deque<ImageID>> _idx;
+    Context const * _ctx;
+    Tile* _data;
+    double _ev;
+    std::uint64_t _hash;    // 2段階目のハッシュ値に、盤面に置いた(位置, 画像片)の鍵を加えたもの
     std::size_t _cntLN;
     std::size_t _ctIdx;
+    FillStep const * _fill;     // 埋める位置の順序
 
 
-    void insert(std::size_t i){
-        const ImageID index = convToImageID(i, _1st._pb->div_x());
+    Tile* grid() const { return _data + _ctx->maskN; }
 
-        auto pos = nowPos();
-        ImageID tIh, tIv;
 
-        Direction dir = Direction::left;
-        if(pos[1] > _cntLN){
-            tIh = _idx[pos[0]].back();
-            tIv = _idx[pos[0]-1][pos[1]];
-            dir = Direction::right;
-            _idx[pos[0]].push_back(index);
-        }else{
-            tIh = _idx[pos[0]].front();
-            tIv = _idx[pos[0]-1][pos[1]];
-            _idx[pos[0]].push_front(index);
-        }
+    /**
+    次に埋める位置の、横に隣接する画像片を*pTIhに、その方向を*pDirに、上に隣接する画像片を*pTIvに格納します
+    */
+    void neighbors(ImageID* pTIh, ImageID* pTIv, Direction* pDir) const
+    {
+        FillStep const & step = _fill[_ctIdx];
 
-        _1st._remain[i] = false;
+        *pTIh = _ctx->id(grid()[step.side]);
+        *pDir = step.dir;
+        *pTIv = _ctx->id(grid()[step.cell - _ctx->divX]);
+    }
 
-        _1st._ev += std::abs((*_1st._pred)(tIh,
-                                  index,
-                                  dir));
 
-        _1st._ev += std::abs((*_1st._pred)(tIv,
-                                 index,
-                                 Direction::down));
+    /// 画像片iを、次の位置に置きます
+    void place(std::size_t i){
+        grid()[_fill[_ctIdx].cell] = static_cast<Tile>(i);
 
+        set_bit(_data, i);
         ++_ctIdx;
     }
+};
 
 
-    Index2D nowPos() const {
-        const size_t r = 1 + _ctIdx / (_1st._pb->div_x() - 1);
-        size_t c = _ctIdx % (_1st._pb->div_x() - 1);
+/**
+状態の型Stateのビームの幅を、memoryCapバイトに収まるように幅widthから狭めて返します。
+1つの状態は、ハンドルとブロックを、親と子の2世代分使うものとして見積もります。
+memoryCapが0のときはwidthをそのまま返します。
+*/
+template <typename State>
+std::size_t capped_beam_width(SearchContext<typename State::BinFuncType> const & ctx, std::size_t width, std::size_t memoryCap)
+{
+    if(memoryCap == 0)
+        return width;
 
-        if(c >= _cntLN)
-            ++c;
-        else
-            c = _cntLN - c - 1;
+    const std::size_t perState = 2 * (sizeof(State) + State::block_size(ctx) * sizeof(Tile)) + sizeof(Child);
+    return std::max<std::size_t>(1, std::min(width, memoryCap / perState));
+}
 
-        return makeIndex2D(r, c);
-    }
-};
 
+/**
+Stage1で列を、Stage2で1行目を、Stage3で残りを、それぞれビームサーチで決めます。
 
+configで、ビームの幅(既定値は128)、時間、探索状態のメモリの上限を指定できます。
+時間を過ぎると、その時点で最良の状態を貪欲法で最後まで埋めた結果を返します。
+*/
 template <typename BinFunc>
-std::vector<std::vector<ImageID>> bfs_guess(utils::Problem const & pb, BinFunc const & f)
+std::vector<std::vector<ImageID>> bfs_guess(utils::Problem const & pb, BinFunc const & f,
+                                            SearchConfig const & config = SearchConfig())
 {
-    // stage1
-    std::vector<bool> rem(pb.div_y() * pb.div_x(), true);
+    const SearchContext<BinFunc> ctx(pb, f);
+    const Deadline deadline(config.timeBudget);
+    const std::size_t width = config.beamWidth != 0 ? config.beamWidth : 128;
 
+    // stage1
+    telemetry::begin_stage(config.pTelemetry, "Stage1");
+    StateArena arena1(State1st<BinFunc>::block_size(ctx)), spare1(arena1.blockSize());
     std::deque<State1st<BinFunc>> state1;
-    for(auto i: utils::iota(rem.size())){
-        auto remdup = rem;
-        remdup[i] = false;
-        state1.emplace_back(&pb, &f, std::deque<ImageID>({ convToImageID(i, pb.div_x()) }), remdup, 0.0);
-    }
+    for(auto i: utils::iota(ctx.tileN))
+        state1.emplace_back(&ctx, arena1, i);
 
-    writeln("Stage1");
-    bfs_guess_impl(state1, 128);
+    bfs_guess_impl(state1, capped_beam_width<State1st<BinFunc>>(ctx, width, config.memoryCap), arena1, spare1, deadline, config.pTelemetry);
+    telemetry::end_stage(config.pTelemetry);
 
     // stage2
+    telemetry::begin_stage(config.pTelemetry, "Stage2");
+    StateArena arena2(State2nd<BinFunc>::block_size(ctx)), spare2(arena2.blockSize());
     std::deque<State2nd<BinFunc>> state2;
-    for(State1st<BinFunc>& e: state1)
-        state2.emplace_back(std::move(e));
+    for(State1st<BinFunc> const & e: state1)
+        state2.emplace_back(e, arena2);
 
-    writeln("Stage2");
-    bfs_guess_impl(state2, 128);
+    bfs_guess_impl(state2, capped_beam_width<State2nd<BinFunc>>(ctx, width, config.memoryCap), arena2, spare2, deadline, config.pTelemetry);
+    telemetry::end_stage(config.pTelemetry);
 
     // stage3
+    telemetry::begin_stage(config.pTelemetry, "Stage3");
+    StateArena arena3(State3rd<BinFunc>::block_size(ctx)), spare3(arena3.blockSize());
     std::deque<State3rd<BinFunc>> state3;
-    for(State2nd<BinFunc>& e: state2)
-        state3.emplace_back(std::move(e));
+    for(State2nd<BinFunc> const & e: state2)
+        state3.emplace_back(e, arena3);
 
-    writeln("Stage3");
-    bfs_guess_impl(state3, 128);
+    bfs_guess_impl(state3, capped_beam_width<State3rd<BinFunc>>(ctx, width, config.memoryCap), arena3, spare3, deadline, config.pTelemetry);
+    telemetry::end_stage(config.pTelemetry);
 
     if(state3.empty())
         return guess::guess(pb, f);
-    else{
-        auto mat = state3[0].index();
-        std::vector<std::vector<ImageID>> dst;
-        for(auto& v: mat)
-            dst.emplace_back(v.begin(), v.end());
-
-        return dst;
-    }
+    else
+        return state3[0].index();
 }
 
 
+/**
+画像片ごとに1つずつ起点を選び、それぞれを起点とするビームサーチを並列に行って、最も良い結果を返します。
+各起点の探索は、poolにタスクとして投入します。
+スレッド数はpoolのワーカー数で決まり、Stage1, 2, 3で同じpoolを使い回します。
+
+configの意味はbfs_guessと同じです。ビームの幅の既定値は 4096 / (div_x * div_y) で、
+メモリの上限はすべての起点で等分します。
+*/
 template <typename BinFunc>
-std::vector<std::vector<ImageID>> bfs_guess_parallel(utils::Problem const & pb, BinFunc const & f)
+std::vector<std::vector<ImageID>> bfs_guess_parallel(utils::Problem const & pb, BinFunc const & f,
+                                                     SearchConfig const & config = SearchConfig(),
+                                                     parallel::ThreadPool& pool = parallel::default_pool())
 {
     const std::size_t allTileN = pb.div_y() * pb.div_x();
-    const std::size_t threadN = static_cast<std::size_t>(std::floor(allTileN / (allTileN >= 64 ? std::sqrt(pb.div_y()) : 1) / (allTileN >= 144 ? std::sqrt(pb.div_y()) : 1)));
-
-    // マルチスレッドで`bfs_guess_impl`を呼ぶ
-    auto parallel_guess_impl = [&pb](auto& states){
-        std::vector<std::thread> ths;
-        for(auto& e: states)
-            ths.emplace_back([&](){ bfs_guess_impl(e, 4096 / pb.div_x() / pb.div_y()); });
-
-        std::size_t cnt = 0;
-        for (auto& e : ths){
-            e.join();
-            utils::writeln("end: ", ++cnt);
-        }
+    const std::size_t seedN = static_cast<std::size_t>(std::floor(allTileN / (allTileN >= 64 ? std::sqrt(pb.div_y()) : 1) / (allTileN >= 144 ? std::sqrt(pb.div_y()) : 1)));
+    const SearchContext<BinFunc> ctx(pb, f);
+    const Deadline deadline(config.timeBudget);
+    const std::size_t width = config.beamWidth != 0 ? config.beamWidth : 4096 / pb.div_x() / pb.div_y();
+    const std::size_t memoryCap = config.memoryCap == 0 ? 0 : std::max<std::size_t>(1, config.memoryCap / seedN);
+
+    // 起点ごとの領域
+    auto make_arenas = [&](std::size_t blockSize){
+        std::vector<StateArena> dst;
+        for(std::size_t i = 0; i < seedN * 2; ++i)
+            dst.emplace_back(blockSize);
+        return dst;
     };
 
+    // 起点ごとの`bfs_guess_impl`をpoolで実行する
+    // states[i]の中身はarenas[i*2]にある
+    auto parallel_guess_impl = [&](auto& states, std::vector<StateArena>& arenas){
+        typedef typename std::decay<decltype(states[0][0])>::type State;
+        const std::size_t w = capped_beam_width<State>(ctx, width, memoryCap);
 
-    std::vector<bool> rem(pb.div_x() * pb.div_y(), true);
+        parallel::TaskGroup<void> tasks;
+        for(auto i: utils::iota(states.size()))
+            tasks.push_back(pool.submit([&, i](){ bfs_guess_impl(states[i], w, arenas[i*2], arenas[i*2+1], deadline, config.pTelemetry); }));
 
-    // stage1
-    std::vector<std::deque<State1st<BinFunc>>> state1(threadN);
-    for(auto i: utils::iota(state1.size())){
-        auto remdup = rem;
-        remdup[i] = false;
-        state1[i].emplace_back(&pb, &f, std::deque<ImageID>({ convToImageID(i, pb.div_x()) }), remdup, 0.0);
-    }
+        tasks.wait();
+        for(auto& e: tasks)
+            e.get();
+    };
 
 
-    utils::writeln("Stage1");
-    parallel_guess_impl(state1);
+    // stage1
+    telemetry::begin_stage(config.pTelemetry, "Stage1");
+    auto arenas1 = make_arenas(State1st<BinFunc>::block_size(ctx));
+    std::vector<std::deque<State1st<BinFunc>>> state1(seedN);
+    for(auto i: utils::iota(state1.size()))
+        state1[i].emplace_back(&ctx, arenas1[i*2], i);
+
+    parallel_guess_impl(state1, arenas1);
+    telemetry::end_stage(config.pTelemetry);
 
     // stage2
+    telemetry::begin_stage(config.pTelemetry, "Stage2");
+    auto arenas2 = make_arenas(State2nd<BinFunc>::block_size(ctx));
     std::vector<std::deque<State2nd<BinFunc>>> state2; state2.reserve(state1.size());
-    for(auto& q: state1){
+    for(auto i: utils::iota(state1.size())){
         std::deque<State2nd<BinFunc>> qq;
-        for(auto& e: q)
-            qq.emplace_back(std::move(e));
+        for(auto& e: state1[i])
+            qq.emplace_back(e, arenas2[i*2]);
 
         state2.emplace_back(std::move(qq));
     }
 
-    writeln("Stage2");
-    parallel_guess_impl(state2);
+    parallel_guess_impl(state2, arenas2);
+    telemetry::end_stage(config.pTelemetry);
 
     // stage3
+    telemetry::begin_stage(config.pTelemetry, "Stage3");
+    auto arenas3 = make_arenas(State3rd<BinFunc>::block_size(ctx));
     std::vector<std::deque<State3rd<BinFunc>>> state3; state3.reserve(state2.size());
-    for(auto& q: state2){
+    for(auto i: utils::iota(state2.size())){
         std::deque<State3rd<BinFunc>> qq;
-        for (auto& e : q){
+        for (auto& e : state2[i]){
             if (e.isEnd())
-                qq.emplace_back(std::move(e));
+                qq.emplace_back(e, arenas3[i*2]);
         }
 
         state3.emplace_back(std::move(qq));
     }
 
-    writeln("Stage3");
-    parallel_guess_impl(state3);
+    parallel_guess_impl(state3, arenas3);
+    telemetry::end_stage(config.pTelemetry);
 
 
     // もっとも良い結果の選択
-    State3rd<BinFunc> *minState = nullptr;
+    State3rd<BinFunc> const *minState = nullptr;
     for(auto& q: state3)
         for(auto& e: q)
             if(minState == nullptr || e < *minState)
                 minState = &e;
 
-    if(minState == nullptr){
-        std::cout << "empty !!!" << std::endl;
+    if(minState == nullptr)
         return guess::guess(pb, f);
-    }else{
-        auto mat = minState->index();
-        std::vector<std::vector<ImageID>> dst;
-        for(auto& v: mat)
-            dst.emplace_back(v.begin(), v.end());
+    else
+        return minState->index();
+}
 
-        return dst;
-    }
+
+/**
+既定の設定で、poolを使ってbfs_guess_parallelを実行します
+*/
+template <typename BinFunc>
+std::vector<std::vector<ImageID>> bfs_guess_parallel(utils::Problem const & pb, BinFunc const & f,
+                                                     parallel::ThreadPool& pool)
+{
+    return bfs_guess_parallel(pb, f, SearchConfig(), pool);
 }
 
 
@@ -12,6 +12,7 @@
 #include "../../modify_guess_image/common.hpp"
 #include "../../modify_guess_image/interactive_guess.hpp"
 #include "../../utils/include/dwrite.hpp"
+#include "parallel.hpp"
 
 
 namespace procon { namespace blocked_guess {
@@ -123,8 +124,12 @@ modify::Group createGroup(Problem const & pb, BinFunc const & f, ImageID origin,
 }
 
 
+/**
+いくつかの起点からブロックを作って並べる処理を、poolで並列に行い、最も良い結果を返します。
+*/
 template <typename BinFunc>
-std::vector<std::vector<ImageID>> guess(Problem const & pb, BinFunc const & f)
+std::vector<std::vector<ImageID>> guess(Problem const & pb, BinFunc const & f,
+                                        parallel::ThreadPool& pool = parallel::default_pool())
 {
     std::unordered_set<ImageID> remain;
     DividedImage::foreach(pb, [&](size_t i, size_t j){
@@ -135,24 +140,22 @@ std::vector<std::vector<ImageID>> guess(Problem const & pb, BinFunc const & f)
     modify::OptionalMap omp(pb.div_y(), std::vector<boost::optional<ImageID>>(pb.div_x()));
 
 
-    std::vector<std::future<std::tuple<double, modify::ImgMap>>> ths;
+    parallel::TaskGroup<std::tuple<double, modify::ImgMap>> ths;
     for(auto i: utils::iota(pb.div_x() / getLogExp2(pb.div_x()))){
-        ths.emplace_back(std::async(
-            std::launch::async,
-            [&](size_t i){
+        ths.push_back(pool.submit(
+            [&, i](){
                 std::unordered_set<ImageID> rm = remain;
                 auto gp = createGroup(pb, f, ImageID(0, i), getLogExp2(pb.div_x()), getLogExp2(pb.div_y()), rm);
                 return modify::position_bfs(&gp, &gp + 1, omp, rm, pb, f);
-            },
-            i));
+            }));
     }
 
 
     std::tuple<double, modify::ImgMap> min;
     std::get<0>(min) = std::numeric_limits<double>::infinity();
 
+    ths.wait();
     for(auto& e: ths){
-        e.wait();
         auto res = e.get();
 
         if(std::get<0>(min) >= std::get<0>(res))
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "../../utils/include/image.hpp"
+#include "../../utils/include/types.hpp"
+#include "batch_eval.hpp"
+#include "edge_storage.hpp"
+#include "parallel.hpp"
+
+
+namespace procon { namespace guess {
+
+/**
+各(画像片, 方向)について、その方向にくっつけたときの評価値の絶対値が小さい画像片を
+上位K個まで、良い順に並べて保持します。
+
+貪欲法の各ステップで、残っている画像片すべてを調べる代わりに、
+この上位K個の中からまだ使われていない最良のものを取り出せます。
+K個すべてが使われてしまった場合は、呼び出し側で全体を調べ直す必要があります。
+*/
+class CandidateIndex
+{
+  public:
+    struct Candidate
+    {
+        std::size_t ordinal;    // 画像片の序数
+        double value;           // 評価値の絶対値
+    };
+
+
+    CandidateIndex() : _divX(0), _tileN(0), _k(0) {}
+
+
+    /**
+    比較関数fを使って、すべての(画像片, 方向)の上位k個を求めます。
+    画像片ごとのタスクをpoolに投入して、並列に求めます。
+
+    fはevaluate_batch()でまとめて呼び出し、すべての組の値を一度表に入れてから並べます。
+    is_symmetric<BinFunc>::valueがtrueのときは、f(a, b, left) == f(b, a, right), f(a, b, up) == f(b, a, down)
+    を使って、rightとdownの組だけを評価します(2 * N * N回、作業領域は2 * N * N個のdouble)。
+    そうでなければ、4方向すべてを評価します(4 * N * N回、作業領域は4 * N * N個のdouble)。
+    */
+    template <typename BinFunc>
+    CandidateIndex(utils::Problem const & pb, BinFunc const & f, std::size_t k,
+                   parallel::ThreadPool& pool = parallel::default_pool())
+    : _divX(pb.div_x()), _tileN(pb.div_x() * pb.div_y()),
+      _k(std::min(k, pb.div_x() * pb.div_y() - 1)),
+      _list(_tileN * 4 * _k)
+    {
+        const bool symmetric = is_symmetric<BinFunc>::value;
+        const std::size_t planeN = symmetric ? 2 : 4;
+
+        std::vector<utils::ImageID> ids;
+        ids.reserve(_tileN);
+        for(std::size_t i = 0; i < _tileN; ++i)
+            ids.emplace_back(i / _divX, i % _divX);
+
+        // table[(p * N + i1) * N + i2] = |f(i1, i2, pの方向)|
+        // pの方向は、対称ならcanonical_direction(p)、そうでなければDirection(p)
+        std::vector<double> table(planeN * _tileN * _tileN);
+        run_per_tile(pool, [&](std::size_t i1){
+            for(std::size_t p = 0; p < planeN; ++p){
+                double* row = table.data() + (p * _tileN + i1) * _tileN;
+                evaluate_batch(f, ids[i1], ids.data(), _tileN,
+                               symmetric ? canonical_direction(p) : static_cast<utils::Direction>(p), row);
+
+                for(std::size_t i2 = 0; i2 < _tileN; ++i2)
+                    row[i2] = std::abs(row[i2]);
+            }
+        });
+
+        run_per_tile(pool, [&](std::size_t i1){
+            std::vector<Candidate> all, work; all.reserve(_tileN);
+
+            for(std::size_t d = 0; d < 4; ++d){
+                // 対称のとき、leftとupはtableの列を読む
+                double const * p = table.data() + (d * _tileN + i1) * _tileN;
+                std::size_t stride = 1;
+                if(symmetric){
+                    std::size_t a = i1, b = _tileN;
+                    const std::size_t c = canonicalize(a, b, static_cast<utils::Direction>(d));
+                    p = table.data() + c * _tileN * _tileN + (a == i1 ? i1 * _tileN : i1);
+                    stride = (a == i1 ? 1 : _tileN);
+                }
+
+                all.clear();
+                for(std::size_t i2 = 0; i2 < _tileN; ++i2, p += stride)
+                    if(i2 != i1)
+                        all.push_back(Candidate{i2, *p});
+
+                if(_k == all.size())
+                    sort_all(all, work);
+                else
+                    std::partial_sort(all.begin(), all.begin() + _k, all.end(), better);
+
+                std::copy(all.begin(), all.begin() + _k, _list.begin() + (i1 * 4 + d) * _k);
+            }
+        });
+    }
+
+
+    std::size_t k() const { return _k; }
+
+
+    Candidate const * begin(utils::ImageID const & tile, utils::Direction dir) const
+    {
+        return _list.data() + (tile_ordinal(tile, _divX) * 4 + static_cast<std::size_t>(dir)) * _k;
+    }
+
+
+    Candidate const * end(utils::ImageID const & tile, utils::Direction dir) const
+    {
+        return begin(tile, dir) + _k;
+    }
+
+
+    /**
+    画像片tileのdir方向の候補のうち、isRemain(ImageID)がtrueな最良のものを*pIdxに、
+    その評価値の絶対値を*pValueに格納してtrueを返します。
+    上位K個がすべてisRemainを満たさないときはfalseを返します。
+    */
+    template <typename IsRemain>
+    bool best(utils::ImageID const & tile, utils::Direction dir, IsRemain const & isRemain,
+              utils::ImageID* pIdx, double* pValue) const
+    {
+        for(auto p = begin(tile, dir), e = end(tile, dir); p != e; ++p){
+            const utils::ImageID id(p->ordinal / _divX, p->ordinal % _divX);
+            if(isRemain(id)){
+                if(pIdx)
+                    *pIdx = id;
+                if(pValue)
+                    *pValue = p->value;
+
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+
+  private:
+    std::size_t _divX;
+    std::size_t _tileN;
+    std::size_t _k;
+    std::vector<Candidate> _list;   // [tile][dir][rank]
+
+
+    /// 画像片ごとにf(i1)をpoolで実行し、すべて終わるのを待ちます
+    template <typename F>
+    void run_per_tile(parallel::ThreadPool& pool, F const & f) const
+    {
+        parallel::TaskGroup<void> tasks;
+        for(std::size_t i1 = 0; i1 < _tileN; ++i1)
+            tasks.push_back(pool.submit([&f, i1](){ f(i1); }));
+
+        tasks.wait();
+        for(auto& e: tasks)
+            e.get();
+    }
+
+
+    static bool better(Candidate const & x, Candidate const & y)
+    {
+        return x.value < y.value || (x.value == y.value && x.ordinal < y.ordinal);
+    }
+
+
+    /// 評価値(>= 0)をfloatに丸めたビット列。評価値の順序を保ちます
+    static std::uint32_t sort_key(Candidate const & c)
+    {
+        const float v = static_cast<float>(c.value);
+        std::uint32_t bits;
+        std::memcpy(&bits, &v, sizeof(bits));
+        return bits;
+    }
+
+
+    /**
+    ordinalの順に並んだallを、better()の順に並べ替えます。
+    sort_key()の基数ソートは安定なので、キーが同じものはordinalの順に残ります。
+    floatへの丸めで同じキーになったものだけ、最後の挿入ソートで並べ直します。
+    すべての候補を並べるときは、std::sortよりもこちらのほうが速いです。
+    */
+    static void sort_all(std::vector<Candidate>& all, std::vector<Candidate>& work)
+    {
+        work.resize(all.size());
+        for(std::size_t shift = 0; shift < 32; shift += 8){
+            std::size_t cnt[257] = {};
+            for(auto& e: all)
+                ++cnt[((sort_key(e) >> shift) & 0xFF) + 1];
+
+            if(std::find(cnt + 1, cnt + 257, all.size()) != cnt + 257)
+                continue;       // すべて同じ桁
+
+            for(std::size_t i = 0; i < 256; ++i)
+                cnt[i + 1] += cnt[i];
+
+            for(auto& e: all)
+                work[cnt[(sort_key(e) >> shift) & 0xFF]++] = e;
+
+            all.swap(work);
+        }
+
+        for(std::size_t i = 1; i < all.size(); ++i)
+            for(std::size_t j = i; j > 0 && better(all[j], all[j-1]); --j)
+                std::swap(all[j], all[j-1]);
+    }
+};
+
+}}
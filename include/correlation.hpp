@@ -1,93 +1,140 @@
 #pragma once
 
 #include <algorithm>
-#include <unordered_map>
+#include <cstdint>
 #include <vector>
 
 #include "../../utils/include/image.hpp"
 #include "../../utils/include/types.hpp"
 #include "../../utils/include/constants.hpp"
+#include "edge_storage.hpp"
+#include "parallel.hpp"
+#include "simd_kernel.hpp"
 
 
 namespace procon { namespace guess {
 
-struct Correlator
+/**
+画像片の境界の画素を記憶しておき、2つの画像片の境界の画素の差の絶対値の平均を返します。
+
+precomputeがtrueのときは、すべての(画像片, 画像片, 方向)の組に対する値を
+構築時に並列に計算してテーブルに格納し、以降の呼び出しはテーブルを引くだけになります。
+f(a, b, left) == f(b, a, right), f(a, b, up) == f(b, a, down) なので、テーブルには
+方向がrightとdownの組だけを格納します。画像片の数をNとすると、テーブルの大きさはN*N*2です。
+
+構築は画像片ごとに最大threadN個のスレッドで並列に行います(0のときはハードウェアのスレッド数)。
+構築後は読み取り専用なので、1つのオブジェクトを複数のスレッドから同時に呼び出せます。
+
+Tは境界の画素を保持する型で、floatかstd::uint8_tです。
+std::uint8_tのときは、メモリと帯域が1/4になり、整数の差の絶対値の和で比較しますが、
+結果はfloatのときと完全に一致します。
+*/
+template <typename T>
+struct BasicCorrelator
 {
-    Correlator(utils::Problem const & pb)
+    /// f(a, b, left) == f(b, a, right), f(a, b, up) == f(b, a, down) を満たす(guess::is_symmetric)
+    static constexpr bool symmetric = true;
+
+
+    BasicCorrelator(utils::Problem const & pb, bool precompute = false, std::size_t threadN = 0)
+    : _divX(pb.div_x()), _tileN(pb.div_x() * pb.div_y()), _edges(pb, threadN)
     {
-        const size_t w = pb.width() / pb.div_x();
-        const size_t h = pb.height() / pb.div_y();
-
-        for(size_t i = 0; i < pb.div_y(); ++i)
-            for(size_t j = 0; j < pb.div_x(); ++j){
-                auto& img = pb.get_element(i, j);
-                utils::Direction dirs[4] = {utils::Direction::right, utils::Direction::up, utils::Direction::left, utils::Direction::down};
-
-                std::unordered_map<utils::Direction, std::vector<float>> pxsMap;
-
-                for(auto dir: dirs){
-                    if(dir == utils::Direction::up || dir == utils::Direction::down){
-                        const auto l = dir == utils::Direction::up ? 0 : h-1;
-                        std::vector<float> pxs; pxs.reserve(w);
-                        for(size_t k = 0; k < w; ++k){
-                            auto v = img.get_pixel(l, k).vec();
-
-                            for(size_t pidx = 0; pidx < 3; ++pidx)
-                                pxs.emplace_back(v[pidx]);
-                        }
-                        pxsMap.emplace(dir, std::move(pxs));
-                    }
-                    else if(dir == utils::Direction::right || dir == utils::Direction::left){
-                        const auto l = dir == utils::Direction::left ? 0 : w-1;
-                        std::vector<float> pxs; pxs.reserve(h);
-                        for(size_t k = 0; k < h; ++k){
-                            auto v = img.get_pixel(k, l).vec();
-
-                            for(size_t pidx = 0; pidx < 3; ++pidx)
-                                pxs.emplace_back(v[pidx]);
-                        }
-                        pxsMap.emplace(dir, std::move(pxs));
-                    }
-                }
-
-                this->_memo.emplace(utils::ImageID(i, j), std::move(pxsMap));
-            }
+        if(precompute)
+            this->build_table(threadN);
     }
 
 
     double operator()(utils::ImageID const & img1, utils::ImageID const & img2, utils::Direction dir) const
     {
-        const auto dir2 = [&](){
-            switch(dir){
-                case utils::Direction::right: return utils::Direction::left;
-                case utils::Direction::up:    return utils::Direction::down;
-                case utils::Direction::left:  return utils::Direction::right;
-                case utils::Direction::down:  return utils::Direction::up;
-                default:
-                    PROCON_ENFORCE(0, "Switch error");
-                    return utils::Direction::right;
+        if(!_table.empty()){
+            std::size_t i1 = ordinal(img1), i2 = ordinal(img2);
+            const std::size_t c = canonicalize(i1, i2, dir);
+            return _table[table_index(i1, i2, c)];
+        }
+
+        return calc(img1, img2, dir);
+    }
+
+
+    /**
+    各 i < n について out[i] = (*this)(anchor, cands[i], dir) を格納します。
+    anchor側の辺やテーブルの行は1回だけ求めます。
+    */
+    void batch(utils::ImageID const & anchor, utils::ImageID const * cands, std::size_t n,
+               utils::Direction dir, double* out) const
+    {
+        const std::size_t i1 = ordinal(anchor);
+
+        if(!_table.empty()){
+            if(dir == utils::Direction::right || dir == utils::Direction::down){
+                const double* row = _table.data() + table_index(i1, 0, dir == utils::Direction::right ? 0 : 1);
+                for(std::size_t i = 0; i < n; ++i)
+                    out[i] = row[ordinal(cands[i])];
+            }else{
+                const std::size_t c = dir == utils::Direction::left ? 0 : 1;
+                for(std::size_t i = 0; i < n; ++i)
+                    out[i] = _table[table_index(ordinal(cands[i]), i1, c)];
             }
-        }();
-
-        auto& px1 = _memo.at(img1).at(dir);
-        auto p1 = &(px1[0]);
-        auto p2 = &(_memo.at(img2).at(dir2)[0]);
-
-        double sum = 0;
-        const size_t n = px1.size();
-        const auto e1 = p1 + n;
-        while(p1 != e1){
-            sum += std::abs(*p1 - *p2);
-            ++p1; ++p2;
+            return;
         }
 
-        return sum / n;
+        auto p1 = _edges.edge(i1, dir);
+        const auto dir2 = opposite(dir);
+        const size_t len = _edges.length(dir);
+        for(std::size_t i = 0; i < n; ++i)
+            out[i] = static_cast<double>(simd::sad(p1, _edges.edge(ordinal(cands[i]), dir2), len)) / len;
     }
 
 
+    bool isPrecomputed() const { return !_table.empty(); }
+
+
   private:
-    std::unordered_map<utils::ImageID, std::unordered_map<utils::Direction, std::vector<float>>>
-        _memo;
+    std::size_t _divX;
+    std::size_t _tileN;
+    EdgeStorage<T> _edges;
+    std::vector<double> _table;     // [img1][right or down][img2]
+
+
+    std::size_t ordinal(utils::ImageID const & id) const
+    {
+        return tile_ordinal(id, _divX);
+    }
+
+
+    std::size_t table_index(std::size_t i1, std::size_t i2, std::size_t c) const
+    {
+        return (i1 * 2 + c) * _tileN + i2;
+    }
+
+
+    void build_table(std::size_t threadN)
+    {
+        std::vector<double> table(_tileN * 2 * _tileN);
+
+        parallel::parallel_for(0, _tileN, threadN, [&](std::size_t i1){
+            const utils::ImageID img1(i1 / _divX, i1 % _divX);
+            for(std::size_t c = 0; c < 2; ++c)
+                for(std::size_t i2 = 0; i2 < _tileN; ++i2)
+                    table[table_index(i1, i2, c)] = calc(img1, utils::ImageID(i2 / _divX, i2 % _divX), canonical_direction(c));
+        });
+
+        _table = std::move(table);
+    }
+
+
+    double calc(utils::ImageID const & img1, utils::ImageID const & img2, utils::Direction dir) const
+    {
+        auto p1 = _edges.edge(ordinal(img1), dir);
+        auto p2 = _edges.edge(ordinal(img2), opposite(dir));
+
+        const size_t n = _edges.length(dir);
+        return static_cast<double>(simd::sad(p1, p2, n)) / n;
+    }
 };
 
+
+typedef BasicCorrelator<float> Correlator;
+typedef BasicCorrelator<std::uint8_t> QuantizedCorrelator;
+
 }}
\ No newline at end of file
@@ -1,12 +1,14 @@
 #pragma once
 
 #include <algorithm>
-#include <unordered_map>
 #include <vector>
 
 #include "../../utils/include/image.hpp"
 #include "../../utils/include/types.hpp"
 #include "../../utils/include/constants.hpp"
+#include "edge_storage.hpp"
+#include "parallel.hpp"
+#include "simd_kernel.hpp"
 
 
 namespace procon { namespace guess_s {
@@ -14,200 +16,129 @@ namespace procon { namespace guess_s {
 class Ajust
 {
 public:
-	static void ajust( std::vector<float>& pxs , int a )
+	//pxs[0, n)̏ŕϊBƗp̔z͊mۂȂ
+	static void ajust( float* pxs, std::size_t n, int a )
 	{
-		std::vector<float> tpxs = pxs;
-		int w = pxs.size() / a;
+		const std::size_t w = n / a;
+		if (w == 0)
+			return;
 
 		//{PB|P ̂𑫂킹
-		for (size_t k = 0; k < w; ++k)
+		for (int i = 0; i < a; i++)
 		{
-			int km1 = k <= 0 ? k : k - 1;
-			int kp1 = k >= w - 1 ? k : k + 1;
-
-			for (int i = 0; i < a; i++)
+			float* p = pxs + i;
+			float prev = p[0];
+			for (std::size_t k = 0; k < w; ++k)
 			{
-				pxs.at(k * 3 + i) += tpxs.at(km1 * 3 + i)*0.5 + tpxs.at(kp1 * 3 + i)*0.5;
+				const float cur = p[k * a];
+				const float next = k + 1 < w ? p[(k + 1) * a] : cur;
+				p[k * a] += prev*0.5 + next*0.5;
+				prev = cur;
 			}
 		}
 	}
 
-	static void ajust_s(std::vector<float>& pxs, int a)
+	static void ajust_s( float* pxs, std::size_t n, int a )
 	{
-		std::vector<float> tpxs = pxs;
-		int w = pxs.size() / a;
+		const std::size_t w = n / a;
+		if (w == 0)
+			return;
 
 		// 1 , 0 , -1 ̂𑫂킹
-		for (size_t k = 0; k < w; ++k)
+		for (int i = 0; i < a; i++)
 		{
-			int km1 = k <= 0 ? k : k - 1;
-			int kp1 = k >= w - 1 ? k : k + 1;
-
-			for (int i = 0; i < a; i++)
+			float* p = pxs + i;
+			float prev = p[0];
+			for (std::size_t k = 0; k < w; ++k)
 			{
-				pxs.at(k * 3 + i) = tpxs.at(km1 * 3 + i) - tpxs.at(kp1 * 3 + i);
+				const float cur = p[k * a];
+				const float next = k + 1 < w ? p[(k + 1) * a] : cur;
+				p[k * a] = prev - next;
+				prev = cur;
 			}
 		}
 	}
+
+	static void ajust( std::vector<float>& pxs , int a )
+	{
+		ajust(pxs.data(), pxs.size(), a);
+	}
+
+	static void ajust_s(std::vector<float>& pxs, int a)
+	{
+		ajust_s(pxs.data(), pxs.size(), a);
+	}
 };
 
 struct Correlator
 {
+	//f(a, b, left) == f(b, a, right), f(a, b, up) == f(b, a, down) 𖞂(guess::is_symmetric)
+    static constexpr bool symmetric = true;
+
+
 	//ׂẲ摜Ђɑ΂āA㉺EŊ֘AtĂ̕Prbg̉fo^
-    Correlator(utils::Problem const & pb)
+	//摜ЂƂɍőthreadN̃Xbhŕɍ\z(0̂Ƃ̓n[hEFÃXbh)
+    Correlator(utils::Problem const & pb, std::size_t threadN = 0)
+    : _divX(pb.div_x()), _edges(pb, threadN), _edges_s(_edges)
     {
-        const size_t w = pb.width() / pb.div_x();
-        const size_t h = pb.height() / pb.div_y();
+        const utils::Direction dirs[4] = {utils::Direction::right, utils::Direction::up, utils::Direction::left, utils::Direction::down};
 
-        for(size_t i = 0; i < pb.div_y(); ++i)
-            for(size_t j = 0; j < pb.div_x(); ++j)
-			{
-				//摜̎擾
-                auto& img = pb.get_element(i, j);
-
-				//z̍쐬[EAAA]
-                utils::Direction dirs[4] = {utils::Direction::right, utils::Direction::up, utils::Direction::left, utils::Direction::down};
-
-				//Ɖf
-                std::unordered_map<utils::Direction, std::vector<float>> pxsMap;
-				std::unordered_map<utils::Direction, std::vector<float>> pxsMap_s;
-
-				//̐[v
-                for(auto dir: dirs)
-				{
-					//ォȂ
-                    if(dir == utils::Direction::up || dir == utils::Direction::down)
-					{
-                        const auto l = dir == utils::Direction::up ? 0 : h-1;
-						std::vector<float> pxs, pxs_s; pxs_s.reserve(w); pxs.reserve(w);
-						for(size_t k = 0; k < w; ++k)
-						{
-                            auto v = img.get_pixel(l, k).vec();
-							for (size_t pidx = 0; pidx < 3; ++pidx)
-							{
-								pxs.emplace_back(v[pidx]);
-								pxs_s.emplace_back(v[pidx]);
-							}
-						}
-						Ajust::ajust_s(pxs_s, 3);
-                        pxsMap.emplace(dir, std::move(pxs));
-						pxsMap_s.emplace(dir, std::move(pxs_s));
-					}
-                    else if(dir == utils::Direction::right || dir == utils::Direction::left){
-                        const auto l = dir == utils::Direction::left ? 0 : w-1;
-						std::vector<float> pxs, pxs_s; pxs_s.reserve(h); pxs.reserve(h);
-						for (size_t k = 0; k < h; ++k)
-						{
-							auto v = img.get_pixel(k, l).vec();
-							for (size_t pidx = 0; pidx < 3; ++pidx)
-							{
-								pxs.emplace_back(v[pidx]);
-								pxs_s.emplace_back(v[pidx]);
-							}
-						}
-						Ajust::ajust_s(pxs_s, 3);
-						pxsMap.emplace(dir, std::move(pxs));
-						pxsMap_s.emplace(dir, std::move(pxs_s));
-					}
-                }
-
-                this->_memo.emplace(utils::ImageID(i, j), std::move(pxsMap));
-				this->_memo_s.emplace(utils::ImageID(i, j), std::move(pxsMap_s));
-			}
+		//Ƃɗׂ荇f̍
+        parallel::parallel_for(0, _edges_s.tileN(), threadN, [&](std::size_t i){
+            for(auto dir: dirs)
+                Ajust::ajust_s(_edges_s.edge(i, dir), _edges_s.length(dir), 3);
+        });
     }
 
 
     double operator()(utils::ImageID const & img1, utils::ImageID const & img2, utils::Direction dir) const
     {
-        const auto dir2 = [&](){
-            switch(dir){
-                case utils::Direction::right: return utils::Direction::left;
-                case utils::Direction::up:    return utils::Direction::down;
-                case utils::Direction::left:  return utils::Direction::right;
-                case utils::Direction::down:  return utils::Direction::up;
-                default:
-                    PROCON_ENFORCE(0, "Switch error");
-                    return utils::Direction::right;
-            }
-		}();
-
-
-		double sum = 0;
-		double var = 0;
-		double ave = 0;
-
-		{
-			//ʂ
-			auto& px1 = _memo.at(img1).at(dir);
-			auto p1 = &(px1[0]);
-			auto p2 = &(_memo.at(img2).at(dir2)[0]);
-
-			const size_t n = px1.size();
-			const auto e1 = p1 + n;
-
-			//
-			while (p1 != e1){
-				sum += std::abs(*p1 - *p2);
-				++p1; ++p2;
-			}
-
-			p1 = &(px1[0]);
-			p2 = &(_memo.at(img2).at(dir2)[0]);
+        return calc(guess::tile_ordinal(img1, _divX), guess::tile_ordinal(img2, _divX), dir);
+    }
 
-			ave = sum / n;
 
-			while (p1 != e1){
-				auto x = std::abs(*p1 - *p2);
+	//e i < n ɂ out[i] = (*this)(anchor, cands[i], dir) i[
+    void batch(utils::ImageID const & anchor, utils::ImageID const * cands, std::size_t n,
+               utils::Direction dir, double* out) const
+    {
+        const size_t i1 = guess::tile_ordinal(anchor, _divX);
+        for(std::size_t i = 0; i < n; ++i)
+            out[i] = calc(i1, guess::tile_ordinal(cands[i], _divX), dir);
+    }
 
-				var += std::abs((x - ave));
 
-				++p1; ++p2;
-			}
+  private:
+    std::size_t _divX;
+    guess::EdgeStorage<float> _edges;      // Ẻf
+	guess::EdgeStorage<float> _edges_s;    // Ẻf̌z
 
-			var /= n;
-		}
 
-		double sums = 0;
-		double vars = 0;
-		double aves = 0;
+    double calc(std::size_t i1, std::size_t i2, utils::Direction dir) const
+    {
+        const auto dir2 = guess::opposite(dir);
+        const size_t n = _edges.length(dir);
 
-		{
-			//
-			auto& px1 = _memo_s.at(img1).at(dir);
-			auto p1 = &(px1[0]);
-			auto p2 = &(_memo_s.at(img2).at(dir2)[0]);
-
-			const size_t n = px1.size();
-			const auto e1 = p1 + n;
-
-			//
-			while (p1 != e1){
-				sums += std::abs(*p1 - *p2);
-				++p1; ++p2;
-			}
 
-			p1 = &(px1[0]);
-			p2 = &(_memo_s.at(img2).at(dir2)[0]);
+		//ʂ̂Ɣ̂̕ς1̑ł܂Ƃ߂ċ߂
+		auto p1 = _edges.edge(i1, dir);
+		auto p2 = _edges.edge(i2, dir2);
+		auto s1 = _edges_s.edge(i1, dir);
+		auto s2 = _edges_s.edge(i2, dir2);
 
-			aves = sums / n;
+		double sum, sums;
+		simd::fused_stats(p1, p2, s1, s2, n, &sum, &sums);
 
-			while (p1 != e1){
-				auto x = std::abs(*p1 - *p2);
-				vars += (x - aves)*(x - aves);
-				++p1; ++p2;
-			}
+		const double ave = sum / n;
+		const double aves = sums / n;
 
-			vars /= n;
-		}
+		//ϕ΍ƕÚAς܂Ă畽ςƂ̍ŋ߂
+		//(E[x^2] - E[x]^2 ͌̂ŎgȂ)
+		const double var = simd::abs_dev(p1, p2, n, ave) / n;
+		const double vars = simd::sq_dev(s1, s2, n, aves) / n;
 
 
         return ave * var * aves * vars;
     }
-
-
-  private:
-    std::unordered_map<utils::ImageID, std::unordered_map<utils::Direction, std::vector<float>>> _memo;
-	std::unordered_map<utils::ImageID, std::unordered_map<utils::Direction, std::vector<float>>> _memo_s;
 };
 
 }}
\ No newline at end of file
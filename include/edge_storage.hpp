@@ -0,0 +1,342 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "../../utils/include/image.hpp"
+#include "../../utils/include/types.hpp"
+#include "../../utils/include/constants.hpp"
+#include "parallel.hpp"
+
+
+namespace procon { namespace guess {
+
+/**
+Align バイト境界に揃えたメモリを確保するアロケータ
+*/
+template <typename T, std::size_t Align = 64>
+struct AlignedAllocator
+{
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind { typedef AlignedAllocator<U, Align> other; };
+
+    AlignedAllocator() = default;
+
+    template <typename U>
+    AlignedAllocator(AlignedAllocator<U, Align> const &) {}
+
+
+    T* allocate(std::size_t n)
+    {
+        // 確保したブロックの先頭アドレスを、揃えたアドレスの直前に保存しておく
+        void* raw = ::operator new(n * sizeof(T) + Align + sizeof(void*));
+        const std::uintptr_t p = reinterpret_cast<std::uintptr_t>(raw) + sizeof(void*);
+        void* aligned = reinterpret_cast<void*>((p + Align - 1) & ~static_cast<std::uintptr_t>(Align - 1));
+        static_cast<void**>(aligned)[-1] = raw;
+        return static_cast<T*>(aligned);
+    }
+
+
+    void deallocate(T* p, std::size_t)
+    {
+        ::operator delete(reinterpret_cast<void**>(p)[-1]);
+    }
+
+
+    template <typename U>
+    bool operator==(AlignedAllocator<U, Align> const &) const { return true; }
+
+    template <typename U>
+    bool operator!=(AlignedAllocator<U, Align> const &) const { return false; }
+};
+
+
+/**
+方向dirの逆方向を返します
+*/
+inline utils::Direction opposite(utils::Direction dir)
+{
+    switch(dir){
+        case utils::Direction::right: return utils::Direction::left;
+        case utils::Direction::up:    return utils::Direction::down;
+        case utils::Direction::left:  return utils::Direction::right;
+        case utils::Direction::down:  return utils::Direction::up;
+        default:
+            PROCON_ENFORCE(0, "Switch error");
+            return utils::Direction::right;
+    }
+}
+
+
+/**
+方向Dirの逆方向を、コンパイル時に求めます
+*/
+template <utils::Direction Dir>
+struct Opposite
+{
+    static constexpr utils::Direction value = static_cast<utils::Direction>((static_cast<std::size_t>(Dir) + 2) % 4);
+};
+
+
+/**
+境界の比較は対称なので、f(a, b, left) == f(b, a, right), f(a, b, up) == f(b, a, down) です。
+これを使って(i1, i2, dir)を、方向がrightかdownの組に正規化します。
+i1, i2は必要なら入れ替えられ、正規化後の方向の番号(right: 0, down: 1)を返します。
+*/
+inline std::size_t canonicalize(std::size_t& i1, std::size_t& i2, utils::Direction dir)
+{
+    switch(dir){
+        case utils::Direction::right: return 0;
+        case utils::Direction::down:  return 1;
+        case utils::Direction::left:  std::swap(i1, i2); return 0;
+        case utils::Direction::up:    std::swap(i1, i2); return 1;
+        default:
+            PROCON_ENFORCE(0, "Switch error");
+            return 0;
+    }
+}
+
+
+/**
+canonicalize()が返す方向の番号を方向に戻します
+*/
+inline utils::Direction canonical_direction(std::size_t c)
+{
+    return c == 0 ? utils::Direction::right : utils::Direction::down;
+}
+
+
+/**
+画像片(r, c)の序数 r * divX + c を返します
+*/
+inline std::size_t tile_ordinal(utils::ImageID const & id, std::size_t divX)
+{
+    const auto idx = id.get_index();
+    return idx[0] * divX + idx[1];
+}
+
+
+namespace detail {
+
+/**
+画像型Imgが、cvMat()で画素の生の領域を公開しているかどうか
+*/
+template <typename Img>
+struct has_raw_storage
+{
+  private:
+    template <typename I>
+    static auto check(I const * img) -> decltype(
+        img->cvMat().template ptr<unsigned char>(0),
+        static_cast<std::size_t>(img->cvMat().step),
+        img->cvMat().type(),
+        std::true_type());
+
+    template <typename I>
+    static std::false_type check(...);
+
+  public:
+    static constexpr bool value = decltype(check<Img>(nullptr))::value;
+};
+
+
+template <utils::Direction Dir, typename T, typename Img>
+void load_edge_by_pixel(Img const & img, T* out)
+{
+    const std::size_t w = img.width();
+    const std::size_t h = img.height();
+
+    if(Dir == utils::Direction::up || Dir == utils::Direction::down){
+        const auto l = Dir == utils::Direction::up ? 0 : h-1;
+        for(std::size_t k = 0; k < w; ++k){
+            auto v = img.get_pixel(l, k).vec();
+
+            for(std::size_t pidx = 0; pidx < 3; ++pidx)
+                *out++ = static_cast<T>(v[pidx]);
+        }
+    }
+    else{
+        const auto l = Dir == utils::Direction::left ? 0 : w-1;
+        for(std::size_t k = 0; k < h; ++k){
+            auto v = img.get_pixel(k, l).vec();
+
+            for(std::size_t pidx = 0; pidx < 3; ++pidx)
+                *out++ = static_cast<T>(v[pidx]);
+        }
+    }
+}
+
+
+template <utils::Direction Dir, typename T, typename Img>
+void load_edge(Img const & img, T* out, std::false_type)
+{
+    load_edge_by_pixel<Dir>(img, out);
+}
+
+
+/*
+cvMat()の領域から直接読み込みます。
+上下の辺は1行の連続した領域をそのまま読み、左右の辺は行の間隔(step)ずつポインタを進めながら読みます。
+8bit 3チャンネル以外の画像のときは、get_pixel()を使います。
+*/
+template <utils::Direction Dir, typename T, typename Img>
+void load_edge(Img const & img, T* out, std::true_type)
+{
+    auto const & m = img.cvMat();
+    if(m.type() != CV_8UC3){
+        load_edge_by_pixel<Dir>(img, out);
+        return;
+    }
+
+    const std::size_t w = img.width();
+    const std::size_t h = img.height();
+
+    if(Dir == utils::Direction::up || Dir == utils::Direction::down){
+        unsigned char const * p = m.template ptr<unsigned char>(static_cast<int>(Dir == utils::Direction::up ? 0 : h-1));
+        for(std::size_t k = 0; k < w * 3; ++k)
+            out[k] = static_cast<T>(p[k]);
+    }
+    else{
+        const std::size_t step = static_cast<std::size_t>(m.step);
+        unsigned char const * p = m.template ptr<unsigned char>(0) + (Dir == utils::Direction::left ? 0 : w-1) * 3;
+        for(std::size_t k = 0; k < h; ++k, p += step){
+            *out++ = static_cast<T>(p[0]);
+            *out++ = static_cast<T>(p[1]);
+            *out++ = static_cast<T>(p[2]);
+        }
+    }
+}
+
+} // namespace detail
+
+
+/**
+画像imgのDir方向の境界の画素を、RGBの順にoutへ書き込みます。
+outには (上下なら幅, 左右なら高さ) * 3 個の要素が書き込まれます。
+方向はコンパイル時に決まるので、方向による分岐はありません。
+
+imgがcvMat()で画素の領域を公開している場合は、get_pixel()を使わずにその領域から直接読み込みます。
+*/
+template <utils::Direction Dir, typename T, typename Img>
+void load_edge(Img const & img, T* out)
+{
+    detail::load_edge<Dir>(img, out, std::integral_constant<bool, detail::has_raw_storage<Img>::value>());
+}
+
+
+/**
+方向を実行時に与える版のload_edge
+*/
+template <typename T, typename Img>
+void load_edge(Img const & img, utils::Direction dir, T* out)
+{
+    switch(dir){
+        case utils::Direction::right:   load_edge<utils::Direction::right>(img, out); break;
+        case utils::Direction::up:      load_edge<utils::Direction::up>(img, out); break;
+        case utils::Direction::left:    load_edge<utils::Direction::left>(img, out); break;
+        case utils::Direction::down:    load_edge<utils::Direction::down>(img, out); break;
+    }
+}
+
+
+/**
+画像imgのDir方向の境界の画素を、スレッドごとの作業領域slot(0か1)に読み込み、その先頭を返します。
+返されたポインタは、同じスレッドで同じslotに次に読み込むまで有効です。
+*/
+template <utils::Direction Dir, typename Img>
+float const * load_edge_tls(Img const & img, std::size_t slot)
+{
+    thread_local std::vector<float> bufs[2];
+
+    auto& buf = bufs[slot];
+    buf.resize((Dir == utils::Direction::up || Dir == utils::Direction::down ? img.width() : img.height()) * 3);
+    load_edge<Dir>(img, buf.data());
+    return buf.data();
+}
+
+
+/**
+すべての画像片の境界の画素を、方向ごとに1つの連続したバッファに格納します。
+
+方向dirのバッファには、序数0の画像片の辺、序数1の画像片の辺、...が順に並んでいます。
+各辺の先頭は64バイト境界に揃えられています。
+*/
+template <typename T>
+class EdgeStorage
+{
+  public:
+    static constexpr std::size_t alignment = 64;
+
+
+    EdgeStorage() : _tileN(0), _len{}, _stride{} {}
+
+
+    /**
+    tileN個の、幅w, 高さhの画像片の辺を格納する領域を確保します
+    */
+    EdgeStorage(std::size_t tileN, std::size_t w, std::size_t h)
+    : _tileN(tileN)
+    {
+        const std::size_t unit = alignment / sizeof(T);
+
+        for(std::size_t d = 0; d < 4; ++d){
+            const auto dir = static_cast<utils::Direction>(d);
+            _len[d] = (dir == utils::Direction::up || dir == utils::Direction::down ? w : h) * 3;
+            _stride[d] = (_len[d] + unit - 1) / unit * unit;
+            _buf[d].assign(_stride[d] * tileN, T());
+        }
+    }
+
+
+    /**
+    問題pbのすべての画像片の辺を読み込みます。
+    画像片ごとに、最大threadN個のスレッドで並列に読み込みます(0のときはハードウェアのスレッド数)。
+    */
+    explicit EdgeStorage(utils::Problem const & pb, std::size_t threadN = 0)
+    : EdgeStorage(pb.div_x() * pb.div_y(), pb.width() / pb.div_x(), pb.height() / pb.div_y())
+    {
+        parallel::parallel_for(0, _tileN, threadN, [&](std::size_t ord){
+            auto& img = pb.get_element(ord / pb.div_x(), ord % pb.div_x());
+
+            for(std::size_t d = 0; d < 4; ++d)
+                load_edge(img, static_cast<utils::Direction>(d), edge(ord, static_cast<utils::Direction>(d)));
+        });
+    }
+
+
+    std::size_t tileN() const { return _tileN; }
+
+
+    /// dir方向の1辺の要素数
+    std::size_t length(utils::Direction dir) const { return _len[static_cast<std::size_t>(dir)]; }
+
+
+    T* edge(std::size_t ord, utils::Direction dir)
+    {
+        const std::size_t d = static_cast<std::size_t>(dir);
+        return _buf[d].data() + ord * _stride[d];
+    }
+
+
+    T const * edge(std::size_t ord, utils::Direction dir) const
+    {
+        const std::size_t d = static_cast<std::size_t>(dir);
+        return _buf[d].data() + ord * _stride[d];
+    }
+
+
+  private:
+    std::size_t _tileN;
+    std::size_t _len[4];
+    std::size_t _stride[4];
+    std::vector<T, AlignedAllocator<T, alignment>> _buf[4];
+};
+
+}}
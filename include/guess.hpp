@@ -4,46 +4,35 @@
 #include "../../utils/include/template.hpp"
 #include "../../utils/include/types.hpp"
 #include "../../utils/include/range.hpp"
+#include "../../utils/include/exception.hpp"
+#include "batch_eval.hpp"
+#include "candidate_index.hpp"
+#include "edge_storage.hpp"
+#include "parallel.hpp"
+#include "simd_kernel.hpp"
+#include "tile_set.hpp"
 
 #include <vector>
 #include <set>
 #include <array>
 #include <deque>
-#include <unordered_set>
 
 namespace procon { namespace guess {
 
 using namespace utils;
 
 /**
-Predicate fは、f(image1, image2, Direction::up) -> double を返す
-doubleの`絶対値の値が小さい方`を優先します。
-
-こんなふうに使う。g++4.9だとgeneric lambdaが使えるけど、g++4.8とかだと使えないしつらい。
-Example:
-------------
-auto idxRC = guess(problem, [](Image const & p1,
-                               Image const & p2,
-                               Direction dir)
-                               {
-                                    // ... 比較関数
-                                    // p1のdir方向にp2がどれだけ結合しやすいかをdoubleで返す。
-                                    // 返す値は、別に[0, 1)じゃなくてもいい。
-                                    // 負の数を返しても良いし、infinityを返しても良い
-                               });
-------------
+画像片originを起点にして、guess()と同じ貪欲法で画像を並べます。
+guess()は、originが(0, 0)のときと同じです。
+Predicate fとpIndexの意味はguess()と同じです。
 */
 template <typename BinFunc>
-std::vector<std::vector<ImageID>> guess(Problem const & problem, BinFunc const & f)
+std::vector<std::vector<ImageID>> guess_from(Problem const & problem, BinFunc const & f, ImageID const & origin,
+                                             CandidateIndex const * pIndex = nullptr)
 {
     auto remain = [&](){
-        std::unordered_set<ImageID> dst;
-        for(auto r : iota(problem.div_y()))
-            for(auto c : iota(problem.div_x())){
-                dst.insert(ImageID(r, c));
-            }
-
-        dst.erase(ImageID(0, 0));  // (0, 0)は原点として最初から使う
+        TileSet dst(problem.div_x(), problem.div_y(), true);
+        dst.erase(origin);  // originは最初から使う
         return dst;
     }();
 
@@ -53,6 +42,8 @@ std::vector<std::vector<ImageID>> guess(Problem const & problem, BinFunc const &
     {
         std::deque<ImageID> dst;
         dst.push_back(origin);      // 最初に原点がある
+
+        std::vector<double> vals;       // 残っている画像をまとめて評価した値
         for(auto t : iota(isVerticalLine ? problem.div_y()-1 : problem.div_x()-1)){
             Direction dir;
             ImageID mIdx;
@@ -68,14 +59,26 @@ std::vector<std::vector<ImageID>> guess(Problem const & problem, BinFunc const &
                 if(dI == 1)
                     tgtIdx = dst.size() - 1;
 
-                for(auto& idx : remain){    // 残っている画像の中から探す
-                    const double v = std::abs(f(dst[tgtIdx],
-                                                idx,
-                                                d));
+                ImageID cIdx;
+                double cv;
+                if(pIndex && pIndex->best(dst[tgtIdx], d, [&](ImageID const & id){ return remain.contains(id); }, &cIdx, &cv)){
+                    if(min >= cv){
+                        min = cv;
+                        dir = d;
+                        mIdx = cIdx;
+                    }
+                    continue;
+                }
+
+                vals.resize(remain.size());
+                evaluate_batch(f, dst[tgtIdx], remain.data(), remain.size(), d, vals.data());
+
+                for(std::size_t i = 0; i < remain.size(); ++i){    // 残っている画像の中から探す
+                    const double v = std::abs(vals[i]);
                     if(min >= v){   // min == v == infのときは入れ替える
                         min = v;
                         dir = d;
-                        mIdx = idx;
+                        mIdx = remain.data()[i];
                     }
                 }
             }
@@ -92,11 +95,11 @@ std::vector<std::vector<ImageID>> guess(Problem const & problem, BinFunc const &
     };
 
 
-    // (0, 0)の画像に対して、まずは縦方向に結合し、
+    // originの画像に対して、まずは縦方向に結合し、
     // その後、横方向に結合していく
     // イメージ的には、
     // 1.      ↑                    (R1, C1)
-    //      (0, 0)           =>     (0 , 0 )
+    //      origin           =>      origin
     //         ↓                    (R2, C2)
     //
     // 2. この操作は 1. で求めた各要素に対して行う
@@ -104,13 +107,154 @@ std::vector<std::vector<ImageID>> guess(Problem const & problem, BinFunc const &
     //
     //
     std::vector<std::vector<ImageID>> dst;
-    for(auto& o : guess_oneline(ImageID(0, 0), true))
+    for(auto& o : guess_oneline(origin, true))
         dst.push_back(guess_oneline(o, false));
 
     return dst;
 }
 
 
+/**
+Predicate fは、f(image1, image2, Direction::up) -> double を返す
+doubleの`絶対値の値が小さい方`を優先します。
+
+こんなふうに使う。g++4.9だとgeneric lambdaが使えるけど、g++4.8とかだと使えないしつらい。
+Example:
+------------
+auto idxRC = guess(problem, [](Image const & p1,
+                               Image const & p2,
+                               Direction dir)
+                               {
+                                    // ... 比較関数
+                                    // p1のdir方向にp2がどれだけ結合しやすいかをdoubleで返す。
+                                    // 返す値は、別に[0, 1)じゃなくてもいい。
+                                    // 負の数を返しても良いし、infinityを返しても良い
+                               });
+------------
+
+pIndexがnullptrでないときは、各ステップでまずその上位K個の候補から残っている最良の画像片を選び、
+候補がすべて使われていたときだけ、残っている画像片すべてを調べます。
+*/
+template <typename BinFunc>
+std::vector<std::vector<ImageID>> guess(Problem const & problem, BinFunc const & f, CandidateIndex const * pIndex)
+{
+    return guess_from(problem, f, ImageID(0, 0), pIndex);
+}
+
+
+template <typename BinFunc>
+std::vector<std::vector<ImageID>> guess(Problem const & problem, BinFunc const & f)
+{
+    return guess(problem, f, static_cast<CandidateIndex const *>(nullptr));
+}
+
+
+/**
+並べた画像idxsについて、隣り合うすべての画像の組の評価値の絶対値の和を返します。
+小さいほど良い並べ方です。
+*/
+template <typename BinFunc>
+double layout_score(BinFunc const & f, std::vector<std::vector<ImageID>> const & idxs)
+{
+    double sum = 0;
+    for(std::size_t r = 0; r < idxs.size(); ++r)
+        for(std::size_t c = 0; c < idxs[r].size(); ++c){
+            if(c + 1 < idxs[r].size())
+                sum += std::abs(f(idxs[r][c], idxs[r][c+1], Direction::right));
+
+            if(r + 1 < idxs.size() && c < idxs[r+1].size())
+                sum += std::abs(f(idxs[r][c], idxs[r+1][c], Direction::down));
+        }
+
+    return sum;
+}
+
+
+/**
+origins[i]を起点とする貪欲法をそれぞれ実行し、layout_score()が最小の並べ方を返します。
+各起点はpoolにタスクとして投入するので、スレッド数はpoolのワーカー数で決まります。
+スコアが同じときはoriginsの中で前にある起点の結果を返すので、結果はスレッド数によりません。
+
+fは複数のスレッドから同時に呼び出されます。
+pScoreがnullptrでなければ、選んだ並べ方のスコアが格納されます。
+*/
+template <typename BinFunc>
+std::vector<std::vector<ImageID>> guess_multistart(Problem const & problem, BinFunc const & f,
+                                                   std::vector<ImageID> const & origins,
+                                                   CandidateIndex const * pIndex = nullptr,
+                                                   double* pScore = nullptr,
+                                                   parallel::ThreadPool& pool = parallel::default_pool())
+{
+    PROCON_ENFORCE(!origins.empty(), "起点がありません");
+
+    std::vector<std::vector<std::vector<ImageID>>> results(origins.size());
+    std::vector<double> scores(origins.size());
+
+    parallel::TaskGroup<void> tasks;
+    for(std::size_t i = 0; i < origins.size(); ++i)
+        tasks.push_back(pool.submit([&, i](){
+            results[i] = guess_from(problem, f, origins[i], pIndex);
+            scores[i] = layout_score(f, results[i]);
+        }));
+
+    tasks.wait();
+    for(auto& e: tasks)
+        e.get();
+
+    std::size_t best = 0;
+    for(std::size_t i = 1; i < origins.size(); ++i)
+        if(scores[i] < scores[best])
+            best = i;
+
+    if(pScore)
+        *pScore = scores[best];
+
+    return std::move(results[best]);
+}
+
+
+/**
+すべての画像片を起点にしてguess_multistart()を実行します。
+*/
+template <typename BinFunc>
+std::vector<std::vector<ImageID>> guess_multistart(Problem const & problem, BinFunc const & f,
+                                                   CandidateIndex const * pIndex = nullptr,
+                                                   double* pScore = nullptr,
+                                                   parallel::ThreadPool& pool = parallel::default_pool())
+{
+    std::vector<ImageID> origins;
+    origins.reserve(problem.div_x() * problem.div_y());
+    for(auto r : iota(problem.div_y()))
+        for(auto c : iota(problem.div_x()))
+            origins.emplace_back(r, c);
+
+    return guess_multistart(problem, f, origins, pIndex, pScore, pool);
+}
+
+
+/**
+ある画像img1の方角Dirに対して、画像img2がどの程度相関があるかを返します。
+方向をコンパイル時に与える版のdiff_connectionです。
+*/
+template <Direction Dir, typename T, typename U
+#ifdef SUPPORT_TEMPLATE_CONSTRAINTS
+    , PROCON_TEMPLATE_CONSTRAINTS(is_image<T>() && is_image<U>())    // T, Uともに画像であるという制約
+#endif
+>
+double diff_connection(T const & img1, U const & img2)
+{
+    if(img1.height() != img2.height() || img1.width() != img2.width())
+        return std::numeric_limits<double>::infinity();
+
+    const std::size_t len = Dir == Direction::up || Dir == Direction::down
+                          ? img1.width() : img1.height();
+
+    auto p1 = load_edge_tls<Dir>(img1, 0);
+    auto p2 = load_edge_tls<Opposite<Dir>::value>(img2, 1);
+    return simd::sad(p1, p2, len * 3) / len;
+}
+
+
 /**
 ある画像img1の方角directionに対して、画像img2がどの程度相関があるかを返します。
 相関があるほど返す値は絶対値が小さくなります。
@@ -123,61 +267,15 @@ template <typename T, typename U
 >
 double diff_connection(T const & img1, U const & img2, Direction direction)
 {
-    double sum = 0;
-
-    if(img1.height() != img2.height() || img1.width() != img2.width())
-        return std::numeric_limits<double>::infinity();
-
-    std::size_t r1 = 0, c1 = 0, r2 = 0, c2 = 0;
-    switch(direction)
-    {
-      case Direction::right:
-        c1 = img1.width() - 1;
-        c2 = 0;
-        break;
-
-      case Direction::up:
-        r1 = 0;
-        r2 = img2.height() - 1;
-        break;
-
-      case Direction::left:
-        c1 = 0;
-        c2 =  img2.width() - 1;
-        break;
-
-      case Direction::down:
-        r1 = img1.height() - 1;
-        r2 = 0;
-        break;
+    switch(direction){
+        case Direction::right:  return diff_connection<Direction::right>(img1, img2);
+        case Direction::up:     return diff_connection<Direction::up>(img1, img2);
+        case Direction::left:   return diff_connection<Direction::left>(img1, img2);
+        case Direction::down:   return diff_connection<Direction::down>(img1, img2);
+        default:
+            PROCON_ENFORCE(0, "Switch error");
+            return std::numeric_limits<double>::infinity();
     }
-
-    switch(direction)
-    {
-      case Direction::right:
-      case Direction::left:
-        for(std::size_t r = 0; r < img1.height(); ++r){
-            auto p1 = img1.get_pixel(r, c1).vec();
-            auto p2 = img2.get_pixel(r, c2).vec();
-            for(std::size_t i = 0; i < 3; ++i)
-                sum += std::abs(static_cast<float>(p1[i]) - static_cast<float>(p2[i]));
-        }
-        sum /= img1.height();
-        break;
-
-      case Direction::up:
-      case Direction::down:
-        for(std::size_t c = 0; c < img1.width(); ++c){
-            auto p1 = img1.get_pixel(r1, c).vec();
-            auto p2 = img2.get_pixel(r2, c).vec();
-            for(std::size_t i = 0; i < 3; ++i)
-                sum += std::abs(static_cast<float>(p1[i]) - static_cast<float>(p2[i]));
-        }
-        sum /= img1.width();
-        break;
-    }
-
-    return sum;
 }
 
 
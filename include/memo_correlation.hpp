@@ -0,0 +1,140 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "../../utils/include/image.hpp"
+#include "../../utils/include/types.hpp"
+#include "edge_storage.hpp"
+
+
+namespace procon { namespace guess {
+
+/**
+比較関数fを包み、(画像片, 画像片, 方向)の組ごとにfの値を記憶します。
+
+記憶する場所は、構築時に指定したcapacity個(2の冪に切り上げ)のスロットを持つ表です。
+組は対称性で(画像片, 画像片, rightかdown)の正規形に直し、そのハッシュで決まる1つのスロットに入れます。
+別の組が同じスロットに入るときは上書きするので、問題の大きさによらず、
+使うメモリは capacity * 16 バイト程度で一定です。
+上書きされた組をもう一度問い合わせると、fを呼び出し直します。
+
+スロットの読み書きはatomicな変数に対して行うので、bfs_guess_parallelやblocked_guessのように
+複数のスレッドから同時に呼び出してもロックは取りません。
+書き込み中のスロットは読み飛ばしてfを呼び出すので、同じ組を2回評価することはありますが、結果は同じ値になります。
+
+fは f(a, b, left) == f(b, a, right), f(a, b, up) == f(b, a, down) を満たす必要があります。
+guess::Correlatorやguess_s::Correlatorはこれを満たします。
+
+Example:
+------------
+auto corr = guess::Correlator(problem);
+auto memo = guess::MemoCorrelator<guess::Correlator>(problem, corr, 1 << 20);  // 16MB
+auto idxs = bfs_guess::bfs_guess_parallel(problem, memo);
+------------
+*/
+template <typename BinFunc>
+class MemoCorrelator
+{
+  public:
+    /// 正規形の組で記憶するので、値は常に対称になる(guess::is_symmetric)
+    static constexpr bool symmetric = true;
+
+
+    MemoCorrelator(utils::Problem const & pb, BinFunc const & f, std::size_t capacity)
+    : _f(&f), _divX(pb.div_x()), _tileN(pb.div_x() * pb.div_y()),
+      _shift(64), _slots(nullptr)
+    {
+        std::size_t cap = 1;
+        while(cap < capacity){
+            cap *= 2;
+            --_shift;
+        }
+
+        _mask = cap - 1;
+        _slots.reset(new Slot[cap]);
+        for(std::size_t i = 0; i < cap; ++i){
+            _slots[i].key.store(empty, std::memory_order_relaxed);
+            _slots[i].value.store(0, std::memory_order_relaxed);
+        }
+    }
+
+
+    MemoCorrelator(MemoCorrelator const &) = delete;
+    MemoCorrelator& operator=(MemoCorrelator const &) = delete;
+
+
+    double operator()(utils::ImageID const & img1, utils::ImageID const & img2, utils::Direction dir) const
+    {
+        std::size_t i1 = tile_ordinal(img1, _divX), i2 = tile_ordinal(img2, _divX);
+        const std::size_t c = canonicalize(i1, i2, dir);
+
+        const std::uint64_t key = (static_cast<std::uint64_t>(c) * _tileN + i1) * _tileN + i2;
+        Slot& slot = _slots[slot_index(key)];
+
+        // 値を読む前後でkeyが変わっていなければ、その値はkeyの組のもの
+        std::uint64_t k = slot.key.load(std::memory_order_acquire);
+        if(k == key){
+            const double v = slot.value.load(std::memory_order_acquire);
+            if(slot.key.load(std::memory_order_relaxed) == key)
+                return v;
+        }
+
+        const double v = (*_f)(utils::ImageID(i1 / _divX, i1 % _divX),
+                               utils::ImageID(i2 / _divX, i2 % _divX),
+                               canonical_direction(c));
+
+        // 他のスレッドが書き込み中なら、記憶せずに返す
+        k = slot.key.load(std::memory_order_relaxed);
+        if(k != busy && slot.key.compare_exchange_strong(k, busy, std::memory_order_relaxed)){
+            slot.value.store(v, std::memory_order_release);
+            slot.key.store(key, std::memory_order_release);
+        }
+
+        return v;
+    }
+
+
+    /// スロットの数
+    std::size_t capacity() const { return _mask + 1; }
+
+
+  private:
+    static constexpr std::uint64_t empty = ~static_cast<std::uint64_t>(0);
+    static constexpr std::uint64_t busy = empty - 1;
+
+    struct Slot
+    {
+        std::atomic<std::uint64_t> key;     // 正規形の組の番号、emptyかbusy
+        std::atomic<double> value;
+    };
+
+
+    BinFunc const * _f;
+    std::size_t _divX;
+    std::size_t _tileN;
+    std::size_t _mask;
+    unsigned int _shift;
+    std::unique_ptr<Slot[]> _slots;
+
+
+    /// フィボナッチハッシュ。隣り合った組が隣り合ったスロットに固まらないようにします
+    std::size_t slot_index(std::uint64_t key) const
+    {
+        if(_mask == 0)
+            return 0;
+
+        return static_cast<std::size_t>((key * 0x9E3779B97F4A7C15ull) >> _shift) & _mask;
+    }
+};
+
+
+template <typename BinFunc>
+constexpr std::uint64_t MemoCorrelator<BinFunc>::empty;
+
+template <typename BinFunc>
+constexpr std::uint64_t MemoCorrelator<BinFunc>::busy;
+
+}}
@@ -0,0 +1,297 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace procon { namespace parallel {
+
+/**
+threadNが0のとき、ハードウェアのスレッド数を返します。
+*/
+inline std::size_t resolve_thread_count(std::size_t threadN)
+{
+    if(threadN != 0)
+        return threadN;
+
+    const std::size_t n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : n;
+}
+
+
+/**
+[first, last)の各iに対してf(i)を呼び出します。
+区間を最大threadN個に分割し、それぞれを別スレッドで処理します。
+threadNが0のときは、ハードウェアのスレッド数を使います。
+
+fは異なるiに対して同時に呼び出されるので、スレッドセーフである必要があります。
+*/
+template <typename F>
+void parallel_for(std::size_t first, std::size_t last, std::size_t threadN, F const & f)
+{
+    if(first >= last)
+        return;
+
+    const std::size_t n = last - first;
+    const std::size_t thN = std::min(resolve_thread_count(threadN), n);
+
+    if(thN <= 1){
+        for(std::size_t i = first; i < last; ++i)
+            f(i);
+        return;
+    }
+
+    const std::size_t chunk = (n + thN - 1) / thN;
+    std::vector<std::future<void>> ths;
+    for(std::size_t b = first + chunk; b < last; b += chunk){
+        const std::size_t e = std::min(b + chunk, last);
+        ths.emplace_back(std::async(std::launch::async, [&f, b, e](){
+            for(std::size_t i = b; i < e; ++i)
+                f(i);
+        }));
+    }
+
+    // 先頭のブロックはこのスレッドで処理する
+    for(std::size_t i = first; i < first + chunk; ++i)
+        f(i);
+
+    for(auto& e: ths)
+        e.get();
+}
+
+
+
+/**
+スレッド数が固定されたワークスティーリング方式のスレッドプールです。
+
+ワーカーごとにタスクのキューを持ち、ワーカー自身は自分のキューの末尾から、
+手が空いたときは他のワーカーのキューの先頭からタスクを取り出します。
+プールの外から投入されたタスクは、ワーカーのキューに順番に配られます。
+
+スレッドは構築時に作られ、デストラクタで残っているタスクをすべて実行してから終了します。
+タスクの中で、同じプールに投入した別のタスクの完了を待ってはいけません。
+*/
+class ThreadPool
+{
+  public:
+    /**
+    threadN個のワーカーを作ります(0のときはハードウェアのスレッド数)
+    */
+    explicit ThreadPool(std::size_t threadN = 0)
+    : _pending(0), _next(0), _stop(false)
+    {
+        const std::size_t n = resolve_thread_count(threadN);
+
+        for(std::size_t i = 0; i < n; ++i)
+            _queues.emplace_back(new Queue);
+
+        for(std::size_t i = 0; i < n; ++i)
+            _threads.emplace_back([this, i](){ this->run(i); });
+    }
+
+
+    ThreadPool(ThreadPool const &) = delete;
+    ThreadPool& operator=(ThreadPool const &) = delete;
+
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lk(_m);
+            _stop = true;
+        }
+        _cv.notify_all();
+
+        for(auto& e: _threads)
+            e.join();
+    }
+
+
+    std::size_t size() const { return _threads.size(); }
+
+
+    /**
+    f()を実行するタスクを投入し、その結果を受け取るfutureを返します
+    */
+    template <typename F>
+    auto submit(F f) -> std::future<decltype(f())>
+    {
+        typedef decltype(f()) R;
+
+        auto task = std::make_shared<std::packaged_task<R()>>(std::move(f));
+        std::future<R> fut = task->get_future();
+        push([task](){ (*task)(); });
+        return fut;
+    }
+
+
+  private:
+    struct Queue
+    {
+        std::mutex m;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> _queues;
+    std::vector<std::thread> _threads;
+    std::mutex _m;
+    std::condition_variable _cv;
+    std::size_t _pending;               // キューに入っているタスクの数(_mで保護)
+    std::atomic<std::size_t> _next;     // 外から投入されたタスクを次に入れるキュー
+    bool _stop;
+
+
+    /// このスレッドがワーカーなら、そのプールと番号
+    static std::pair<ThreadPool const *, std::size_t>& worker()
+    {
+        thread_local std::pair<ThreadPool const *, std::size_t> w(nullptr, 0);
+        return w;
+    }
+
+
+    void push(std::function<void()> task)
+    {
+        const std::size_t q = worker().first == this
+                            ? worker().second
+                            : _next.fetch_add(1, std::memory_order_relaxed) % _queues.size();
+
+        {
+            std::lock_guard<std::mutex> lk(_queues[q]->m);
+            _queues[q]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lk(_m);
+            ++_pending;
+        }
+        _cv.notify_one();
+    }
+
+
+    /// 自分のキューの末尾か、他のワーカーのキューの先頭からタスクを取り出します
+    bool take(std::size_t me, std::function<void()>& task)
+    {
+        const std::size_t n = _queues.size();
+        for(std::size_t k = 0; k < n; ++k){
+            Queue& q = *_queues[(me + k) % n];
+            std::lock_guard<std::mutex> lk(q.m);
+            if(q.tasks.empty())
+                continue;
+
+            if(k == 0){
+                task = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            }else{
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+
+            return true;
+        }
+
+        return false;
+    }
+
+
+    void run(std::size_t me)
+    {
+        worker() = std::make_pair(this, me);
+
+        while(1){
+            std::function<void()> task;
+            if(take(me, task)){
+                {
+                    std::lock_guard<std::mutex> lk(_m);
+                    --_pending;
+                }
+                task();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lk(_m);
+            _cv.wait(lk, [this](){ return _stop || _pending != 0; });
+            if(_stop && _pending == 0)
+                return;
+        }
+    }
+};
+
+
+/**
+プロセス全体で共有する、ハードウェアのスレッド数のワーカーを持つスレッドプール
+*/
+inline ThreadPool& default_pool()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+
+/**
+ThreadPool::submit()が返したfutureの集まりです。破棄するときに、すべてのタスクの完了を待ちます。
+
+submit()のfutureは、std::asyncのものと違い、破棄しても完了を待ちません。
+途中のタスクの例外をget()で受け取って抜けると、まだ実行中の他のタスクが参照している
+呼び出し側の変数が先に破棄されてしまうので、タスクのfutureはこれに入れて管理します。
+
+タスクが参照する変数より後にTaskGroupを宣言しておけば、例外で抜けるときも含めて、
+すべてのタスクが終わるまでそれらの変数は破棄されません。
+呼び出し側では、この保証を前提に次のように書きます。
+
+Example:
+------------
+std::vector<double> results(n);
+parallel::TaskGroup<void> tasks;
+for(std::size_t i = 0; i < n; ++i)
+    tasks.push_back(pool.submit([&, i](){ results[i] = f(i); }));
+
+tasks.wait();           // 先にすべての完了を待ってから
+for(auto& e: tasks)
+    e.get();            // 最初の例外を投げ直す
+------------
+*/
+template <typename R>
+class TaskGroup
+{
+  public:
+    TaskGroup() = default;
+    TaskGroup(TaskGroup const &) = delete;
+    TaskGroup& operator=(TaskGroup const &) = delete;
+
+
+    ~TaskGroup()
+    {
+        wait();
+    }
+
+
+    void push_back(std::future<R>&& f) { _futures.push_back(std::move(f)); }
+
+
+    /// すべてのタスクの完了を待ちます。例外は投げません
+    void wait()
+    {
+        for(auto& e: _futures)
+            if(e.valid())
+                e.wait();
+    }
+
+
+    std::size_t size() const { return _futures.size(); }
+    typename std::vector<std::future<R>>::iterator begin() { return _futures.begin(); }
+    typename std::vector<std::future<R>>::iterator end() { return _futures.end(); }
+
+
+  private:
+    std::vector<std::future<R>> _futures;
+};
+
+}}
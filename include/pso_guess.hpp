@@ -18,16 +18,27 @@
 
 #include <algorithm>
 #include <vector>
-#include <iostream>
 #include <memory>
 #include <cmath>
+#include <cstdint>
+#include <future>
 #include <limits>
 #include <random>
 
+#include "parallel.hpp"
+#include "telemetry.hpp"
+
 namespace procon{ namespace pso_guess {
 
 using namespace utils;
 
+//seedから、stream番目の粒子が使う擬似乱数生成器を作る
+//粒子ごとに別の系列になるので、粒子を別々のスレッドで動かしても互いに影響しない
+inline std::mt19937 make_stream(std::uint32_t seed, std::size_t stream){
+    std::seed_seq seq{seed, static_cast<std::uint32_t>(stream)};
+    return std::mt19937(seq);
+}
+
 template <typename BinFunc>
 class Particle{
     private:
@@ -43,11 +54,13 @@ class Particle{
         std::uniform_real_distribution<double> _dist;   //一様分布生成器
         const double _c1 = 2.0;                         //移動係数(pbestへの近づきやすさ)
         const double _c2 = 2.0;                         //移動係数(gbestへの近づきやすさ)
+        size_t _evaluated = 0;                          //calc_pvalueで評価した解の数
+        size_t _comparisons = 0;                        //評価関数を呼び出した回数
 
     public:
         //粒子のランダム生成を行うコンストラクタ
-        Particle(BinFunc f, Problem pro)
-            : _f(f), _problem(pro), _rnd(std::random_device()()), _dist(0.0, 1.0)
+        Particle(BinFunc const & f, Problem const & pro, std::mt19937 const & rnd)
+            : _f(&f), _problem(pro), _rnd(rnd), _dist(0.0, 1.0)
         {
             _dim = _problem.div_x() * _problem.div_y(); //次元の計算
 
@@ -86,6 +99,16 @@ class Particle{
             return _pvalue;
         }
 
+        //これまでに評価した解の数を返す
+        size_t evaluated() const{
+            return _evaluated;
+        }
+
+        //これまでに評価関数を呼び出した回数を返す
+        size_t comparisons() const{
+            return _comparisons;
+        }
+
         //PSOの解を今回の問題に変換(離散化+重複除去)
         //
         //PSOは連続探索空間を探索するアルゴリズム
@@ -155,11 +178,14 @@ class Particle{
                                                    idxs[sy][sx],
                                                   (utils::Direction)k));
                             val += v;
+                            ++_comparisons;
                         }
                     }
                 }
             }
 
+            ++_evaluated;
+
             //_pvalueの更新
             if(val < _pvalue){
                 _pvalue = val;
@@ -168,7 +194,7 @@ class Particle{
         }
 
         //Particleの移動
-        void move(double w, std::vector<double> gbest){
+        void move(double w, std::vector<double> const & gbest){
             //乱数項の生成
             std::vector<double> escape; 
             for(int j=0; j<_dim; j++){
@@ -202,8 +228,14 @@ class Particle{
         }
 };
 
+//pTelemetryがnullptrでなければ、探索の記録を"PSO"という段階として追加する
+//
+//各イテレーションの粒子の移動と評価はpoolで並列に行い、fは複数のスレッドから同時に呼び出される
+//gbestの更新は粒子の番号順に行うので、結果はスレッド数によらない
 template <typename BinFunc>
-std::vector<std::vector<ImageID>> pso_guess(utils::Problem const & problem, BinFunc const & f){
+std::vector<std::vector<ImageID>> pso_guess(utils::Problem const & problem, BinFunc const & f,
+                                            telemetry::Telemetry* pTelemetry = nullptr,
+                                            parallel::ThreadPool& pool = parallel::default_pool()){
     const int p_num = 30;       //粒子数
     const int tmax = 300;       //イテレーション回数
     double w = 0.9;             //慣性項
@@ -211,10 +243,13 @@ std::vector<std::vector<ImageID>> pso_guess(utils::Problem const & problem, BinF
     std::vector<double> gbest;  //粒子みんなの最高評価値
     std::vector<std::vector<ImageID>> dst; //答えとなるインデックス2次元配列
 
-    //粒子の生成
+    telemetry::begin_stage(pTelemetry, "PSO");
+
+    //粒子の生成(乱数の系列は粒子ごとに分ける)
+    const std::uint32_t seed = std::random_device()();
     std::vector<Particle<BinFunc>> p;
     for(int i=0; i < p_num; i++){
-        Particle<BinFunc> t(f, problem);
+        Particle<BinFunc> t(f, problem, make_stream(seed, i));
         p.push_back(t);
     }
 
@@ -233,15 +268,18 @@ std::vector<std::vector<ImageID>> pso_guess(utils::Problem const & problem, BinF
 
     //粒子による探索
     for(int i=0; i < tmax; i++){
-        //以下の1行で評価の遷移をみれる
-        std::cout << i << " " << gvalue << std::endl;
-
         //本来のPSOでは以下の１行を入れるほうがいいはずだが、今回の探索空間ではないほうがよさそうかも
         w = 0.9 - i*1.0/tmax * 0.5;
 
         //粒子の移動 + pbestの更新
+        //粒子は互いに独立なので、gbestの更新までは並列に動かせる
+        parallel::TaskGroup<void> tasks;
         for(int j=0; j < p_num; j++){
-            p[j].move(w, gbest);
+            tasks.push_back(pool.submit([&, j](){ p[j].move(w, gbest); }));
+        }
+        tasks.wait();
+        for(auto& e: tasks){
+            e.get();
         }
 
         //gbestの更新
@@ -254,8 +292,21 @@ std::vector<std::vector<ImageID>> pso_guess(utils::Problem const & problem, BinF
         }
     }
     
-    //最終評価
-    std::cout << "final result : " << gvalue << std::endl;  
+    //探索の記録(評価の遷移はbestでみれる)
+    //粒子は解を捨てないので、prunedとduplicatesは0のまま
+    if(pTelemetry){
+        telemetry::Counters stats;
+        stats.expanded = (size_t)p_num * tmax;                  //粒子の移動回数
+        for(auto& e: p){
+            stats.generated += e.evaluated();                   //評価した解の数
+            stats.comparisons += e.comparisons();
+        }
+        stats.generations = tmax;
+        stats.maxBeam = p_num;
+        stats.best = gvalue;
+        pTelemetry->add(stats);
+    }
+    telemetry::end_stage(pTelemetry);
 
     return dst;
 }
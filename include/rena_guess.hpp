@@ -13,9 +13,14 @@
 #include "../../utils/include/types.hpp"
 #include "../../utils/include/range.hpp"
 #include "../../utils/include/exception.hpp"
+#include "candidate_index.hpp"
+#include "edge_storage.hpp"
+#include "parallel.hpp"
+#include "simd_kernel.hpp"
+#include "tile_set.hpp"
 
 #include <vector>
-#include <unordered_set>
+#include <algorithm>
 #include <array>
 #include <deque>
 
@@ -23,6 +28,58 @@ namespace procon { namespace rena_guess {
 
 using namespace utils;
 
+/**
+ある画像片のある方向にくっつける候補を、CandidateIndexの並び(評価値の絶対値が小さい順)に取り出します。
+
+使われた画像片は、top()で取り出すときにremainに含まれていないものとして読み飛ばします(遅延削除)。
+カーソルは前にしか進まないので、端の画像片が変わらない限り、読み飛ばしは全体で候補の数までです。
+端の画像片が変わったときも、reset()でその画像片の並びの先頭に置き直すだけで、評価関数は呼び出しません。
+*/
+class CandidateCursor
+{
+  public:
+    CandidateCursor(guess::CandidateIndex const & index, std::size_t divX)
+    : _index(&index), _divX(divX), _p(nullptr), _e(nullptr) {}
+
+
+    /// 画像originのdir方向の候補の先頭に置き直します
+    void reset(ImageID const & origin, utils::Direction dir)
+    {
+        _p = _index->begin(origin, dir);
+        _e = _index->end(origin, dir);
+    }
+
+
+    /**
+    remainに含まれる候補のうち、評価値の絶対値が最小のものを返し、その値を*pPVに格納します。
+    評価値が同じときは序数が小さい画像片を返します。
+    remainはreset()を呼び出したときの部分集合である必要があります。
+    */
+    ImageID top(guess::TileSet const & remain, double *pPV)
+    {
+        while(_p != _e && !remain.contains(id(_p->ordinal)))
+            ++_p;
+
+        PROCON_ENFORCE(_p != _e, "候補がありません");
+
+        if(pPV)
+            *pPV = _p->value;
+
+        return id(_p->ordinal);
+    }
+
+
+  private:
+    guess::CandidateIndex const * _index;
+    std::size_t _divX;
+    guess::CandidateIndex::Candidate const * _p;    // 次に調べる候補
+    guess::CandidateIndex::Candidate const * _e;
+
+
+    ImageID id(std::size_t ord) const { return ImageID(ord / _divX, ord % _divX); }
+};
+
+
 /**
 Predicate fは、f(image1, image2, Direction::up) -> double を返す
 doubleの`絶対値の値が小さい方`を優先します。
@@ -40,39 +97,37 @@ auto idxRC = guess(problem, [](utils::ElementImage const & p1,
                                     // 負の数を返しても良いし、infinityを返しても良い
                                });
 ------------
+
+最初に、すべての(画像片, 方向)について他のすべての画像片を評価値の順に並べたCandidateIndexを作り、
+以降の結合はその並びから残っている最良の画像片を取り出すだけで行います。
+評価関数の呼び出しはこのときの 4 * N * N 回だけです(Nは画像片の数)。
+fが guess::is_symmetric (static constexpr bool symmetric = true; をメンバに持つ) で
+f(a, b, left) == f(b, a, right), f(a, b, up) == f(b, a, down) を宣言していれば、
+rightとdownの組だけを評価するので 2 * N * N 回になります。
+guess::Correlatorやguess_s::Correlatorはこれを宣言しています。ラムダ式などの宣言のない比較関数は、
+対称でないものとして4方向すべてを評価します。
+
+CandidateIndexの構築と、縦方向と横方向の各試行は、poolにタスクとして投入して並列に行います。
+fは複数のスレッドから同時に呼び出されます。
+各試行は残っている画像の集合のコピーを使うので、結果はpoolのワーカー数によりません。
 */
 template <typename BinFunc>
-std::vector<std::vector<ImageID>> rena_guess(utils::Problem const & problem, BinFunc const & f)
+std::vector<std::vector<ImageID>> rena_guess(utils::Problem const & problem, BinFunc const & f,
+                                             parallel::ThreadPool& pool = parallel::default_pool())
 {
-    auto remain = [&](){
-        std::unordered_set<ImageID> dst;
-        for(auto r : utils::iota(problem.div_y()))
-            for(auto c : utils::iota(problem.div_x())){
-                dst.insert(ImageID(r, c));
-            }
-        return dst;
-    }();
+    guess::TileSet remain(problem.div_x(), problem.div_y(), true);
+
+
+    const std::size_t tileN = problem.div_x() * problem.div_y();
+    const guess::CandidateIndex index(problem, f, tileN == 0 ? 0 : tileN - 1, pool);
 
 
     /// 画像originのdir方向に最適な画像を選び出す
-    auto choose_best_one = [&](std::unordered_set<ImageID> const & remain, ImageID origin, utils::Direction dir, double *pPV)
+    auto choose_best_one = [&](guess::TileSet const & remain, ImageID origin, utils::Direction dir, double *pPV)
     {
         ImageID mIdx;
-        double min = std::numeric_limits<double>::infinity();
-
-        for(auto const & idx: remain){
-            const double v = std::abs(f(origin,
-                                        idx,
-                                        dir));
-
-            if(min >= v){   // min == v == infのときは入れ替える
-                min = v;
-                mIdx = idx;
-            }
-        }
-
-        if(pPV)
-            *pPV = min;
+        const bool found = index.best(origin, dir, [&](ImageID const & id){ return remain.contains(id); }, &mIdx, pPV);
+        PROCON_ENFORCE(found, "候補がありません");
 
         return mIdx;
     };
@@ -83,7 +138,7 @@ std::vector<std::vector<ImageID>> rena_guess(utils::Problem const & problem, Bin
     // pTopN :  先頭に何個追加したかが格納される。
     // pIncPV : 評価関数の増加値が格納される
     auto guess_bidirectional =
-    [&](std::unordered_set<ImageID> & remain, std::deque<ImageID> & dst, bool isVerticalLine,
+    [&](guess::TileSet & remain, std::deque<ImageID> & dst, bool isVerticalLine,
         std::size_t maxN, std::size_t *pTopN, double *pIncPV)
     {
         PROCON_ENFORCE(dst.size() >= 1, "結合素材の画像が存在しません");
@@ -91,24 +146,32 @@ std::vector<std::vector<ImageID>> rena_guess(utils::Problem const & problem, Bin
         double incPV = 0;
         std::size_t topN = 0;       // 先頭に何個追加したか
 
+        const auto dirF = isVerticalLine ? utils::Direction::up : utils::Direction::left;
+        const auto dirB = isVerticalLine ? utils::Direction::down : utils::Direction::right;
+
+        // 先頭と末尾それぞれの候補
+        // 端の画像が変わったほうだけを置き直す
+        CandidateCursor frontCur(index, problem.div_x()), backCur(index, problem.div_x());
+        frontCur.reset(dst[0], dirF);
+        backCur.reset(dst[dst.size()-1], dirB);
+
         while(!remain.empty() && dst.size() < maxN){
-            auto dir = isVerticalLine ? utils::Direction::up : utils::Direction::left;
             double predValue;
-            ImageID mIdx = choose_best_one(remain, dst[0], dir, &predValue);
+            ImageID mIdx = frontCur.top(remain, &predValue);
+            bool isFront = true;
 
             {
-                const auto dir2 = isVerticalLine ? utils::Direction::down : utils::Direction::right;
                 double predV2;
-                ImageID mIdx2 = choose_best_one(remain, dst[dst.size()-1], dir2, &predV2);
+                ImageID mIdx2 = backCur.top(remain, &predV2);
 
                 if(predV2 < predValue){
-                    dir = dir2;
+                    isFront = false;
                     predValue = predV2;
                     mIdx = std::move(mIdx2);
                 }
             }
 
-            if(dir == (isVerticalLine ? utils::Direction::up : utils::Direction::left)){    // 先頭にくっつける
+            if(isFront){    // 先頭にくっつける
                 dst.push_front(mIdx);
                 ++topN;
             }else                        // 後ろにくっつける
@@ -116,6 +179,11 @@ std::vector<std::vector<ImageID>> rena_guess(utils::Problem const & problem, Bin
 
             incPV += predValue;
             remain.erase(mIdx);         // 決定したので消す
+
+            if(isFront)
+                frontCur.reset(dst[0], dirF);
+            else
+                backCur.reset(dst[dst.size()-1], dirB);
         }
 
         if(pTopN)
@@ -127,7 +195,7 @@ std::vector<std::vector<ImageID>> rena_guess(utils::Problem const & problem, Bin
 
     // 画像リストdstを元にして、単方向に連結していき、最終的に、maxN個の画像のリストになるまで連結を進めます。
     auto guess_singlyLink =
-    [&](std::unordered_set<ImageID> & remain, std::deque<ImageID> & dst, utils::Direction dir,
+    [&](guess::TileSet & remain, std::deque<ImageID> & dst, utils::Direction dir,
         std::size_t maxN, double *pIncPV)
     {
         PROCON_ENFORCE(dst.size() > 0, "結合素材の画像がありません");
@@ -171,22 +239,29 @@ std::vector<std::vector<ImageID>> rena_guess(utils::Problem const & problem, Bin
     double min = std::numeric_limits<double>::infinity();
 
     //垂直の結合で一番評価関数の合計値が最小になるものを探す
-    for(auto i: utils::iota(problem.div_y())){
-        auto org = ImageID(i, 0);
-        remain.erase(org);
-        std::deque<ImageID> list = { org };
-
-        double v;
-        guess_bidirectional(remain, list, true, problem.div_y(), nullptr, &v);
-
-        if(v <= min){
-            min = v;
-            m_ind = i;
-        }
-
-        // remainに list に入っている分を戻す
-        for(auto& e: list)
-            remain.insert(std::move(e));
+    // 各試行は試行の前のremainのコピーを使う
+    {
+        std::vector<double> vs(problem.div_y());
+        parallel::TaskGroup<void> tasks;
+        for(std::size_t i = 0; i < problem.div_y(); ++i)
+            tasks.push_back(pool.submit([&, i](){
+                auto rem = remain;
+                auto org = ImageID(i, 0);
+                rem.erase(org);
+                std::deque<ImageID> list = { org };
+
+                guess_bidirectional(rem, list, true, problem.div_y(), nullptr, &vs[i]);
+            }));
+
+        tasks.wait();
+        for(auto& e: tasks)
+            e.get();
+
+        for(auto i: utils::iota(problem.div_y()))
+            if(vs[i] <= min){
+                min = vs[i];
+                m_ind = i;
+            }
     }
 
     //最小の評価関数になる断片たちを垂直結合
@@ -196,19 +271,26 @@ std::vector<std::vector<ImageID>> rena_guess(utils::Problem const & problem, Bin
     min = std::numeric_limits<double>::infinity();
     std::size_t limLN = 0;
     //水平の結合で一番評価関数の合計値が最小になるものの左連結数と右連結数を計算
-    for(auto& o : vert){
-        std::deque<ImageID> list = { o };
-        double v = 0;
-        std::size_t leftN = 0;
-        guess_bidirectional(remain, list, false, problem.div_x(), &leftN, &v);
-        if(v <= min){
-            min = v;
-            limLN = leftN;
-        }
-
-        for(auto& e: list)
-            if(e != o)
-                remain.insert(std::move(e));
+    {
+        std::vector<double> vs(vert.size(), 0);
+        std::vector<std::size_t> leftNs(vert.size(), 0);
+        parallel::TaskGroup<void> tasks;
+        for(std::size_t i = 0; i < vert.size(); ++i)
+            tasks.push_back(pool.submit([&, i](){
+                auto rem = remain;
+                std::deque<ImageID> list = { vert[i] };
+                guess_bidirectional(rem, list, false, problem.div_x(), &leftNs[i], &vs[i]);
+            }));
+
+        tasks.wait();
+        for(auto& e: tasks)
+            e.get();
+
+        for(std::size_t i = 0; i < vert.size(); ++i)
+            if(vs[i] <= min){
+                min = vs[i];
+                limLN = leftNs[i];
+            }
     }
 
     std::vector<std::vector<ImageID>> dst;
@@ -239,76 +321,45 @@ std::vector<std::vector<ImageID>> rena_guess(utils::Problem const & problem, Bin
  優れていることになってしまうことがある
 */
 
-template <typename T, typename U
+template <utils::Direction Dir, typename T, typename U
 #ifdef SUPPORT_CONSTRAINTS
     , PROCON_TEMPLATE_CONSTRAINTS(utils::is_image<T>() && utils::is_image<U>())   // T, Uともに画像であるという制約
 #endif
 >
-double diff_connection_rena(T const & img1, U const & img2, utils::Direction direction)
+double diff_connection_rena(T const & img1, U const & img2)
 {
-    double eval = 0;
-    double num = 0;
-
     if(img1.height() != img2.height() || img1.width() != img2.width())
         return std::numeric_limits<double>::infinity();
 
-    std::size_t r1 = 0, c1 = 0, r2 = 0, c2 = 0;
-    switch(direction)
-    {
-      case utils::Direction::right:
-        c1 = img1.width() - 1;
-        c2 = 0;
-        break;
-
-      case utils::Direction::up:
-        r1 = 0;
-        r2 = img2.height() - 1;
-        break;
-
-      case utils::Direction::left:
-        c1 = 0;
-        c2 =  img2.width() - 1;
-        break;
-
-      case utils::Direction::down:
-        r1 = img1.height() - 1;
-        r2 = 0;
-        break;
-    }
+    const std::size_t len = Dir == utils::Direction::up || Dir == utils::Direction::down
+                          ? img1.width() : img1.height();
 
-    switch(direction)
-    {
-      case utils::Direction::right:
-      case utils::Direction::left:
-        for(std::size_t r = 0; r < img1.height(); ++r){
-            auto p1 = img1.get_pixel(r, c1).vec();
-            auto p2 = img2.get_pixel(r, c2).vec();
-            for(std::size_t i = 0; i < 3; ++i){
-                auto v = std::abs(static_cast<float>(p1[i]) - static_cast<float>(p2[i]));
-                eval += v;
-
-                if(v < 7) ++num;
-            }
-        }
-        eval /= img1.height();
-        break;
-
-      case utils::Direction::up:
-      case utils::Direction::down:
-        for(std::size_t c = 0; c < img1.width(); ++c){
-            auto p1 = img1.get_pixel(r1, c).vec();
-            auto p2 = img2.get_pixel(r2, c).vec();
-            for(std::size_t i = 0; i < 3; ++i){
-                auto v = std::abs(static_cast<float>(p1[i]) - static_cast<float>(p2[i]));
-                eval += v;
-
-                if(v < 7) ++num;
-            }
-        }
-        eval /= img1.width();
-        break;
-    }
+    auto p1 = guess::load_edge_tls<Dir>(img1, 0);
+    auto p2 = guess::load_edge_tls<guess::Opposite<Dir>::value>(img2, 1);
+
+    double eval = 0;
+    const double num = simd::sad_count(p1, p2, len * 3, 7, &eval);
+    eval /= len;
 
     return eval / (num*100 + 1);
 }
+
+
+template <typename T, typename U
+#ifdef SUPPORT_CONSTRAINTS
+    , PROCON_TEMPLATE_CONSTRAINTS(utils::is_image<T>() && utils::is_image<U>())   // T, Uともに画像であるという制約
+#endif
+>
+double diff_connection_rena(T const & img1, U const & img2, utils::Direction direction)
+{
+    switch(direction){
+        case utils::Direction::right:   return diff_connection_rena<utils::Direction::right>(img1, img2);
+        case utils::Direction::up:      return diff_connection_rena<utils::Direction::up>(img1, img2);
+        case utils::Direction::left:    return diff_connection_rena<utils::Direction::left>(img1, img2);
+        case utils::Direction::down:    return diff_connection_rena<utils::Direction::down>(img1, img2);
+        default:
+            PROCON_ENFORCE(0, "Switch error");
+            return std::numeric_limits<double>::infinity();
+    }
+}
 }} 
@@ -0,0 +1,746 @@
+#pragma once
+
+#include <bitset>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#if !defined(PROCON_SIMD_DISABLE) && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define PROCON_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(PROCON_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+#define PROCON_SIMD_TARGET(isa) __attribute__((target(isa)))
+#else
+#define PROCON_SIMD_TARGET(isa)
+#endif
+
+
+/**
+境界の画素の比較に使う、SIMD命令によるカーネル群です。
+実行時にCPUIDを調べて、使える中でもっとも幅の広い命令セットのカーネルを選びます。
+PROCON_SIMD_DISABLEを定義すると、常にスカラのカーネルを使います。
+*/
+namespace procon { namespace simd {
+
+enum class Isa { scalar, sse2, avx2, avx512 };
+
+
+/**
+a[i]とb[i]の差の絶対値の総和を返すカーネル
+*/
+typedef double (*SadKernel)(float const * a, float const * b, std::size_t n);
+
+
+/**
+a[i]とb[i]の差の絶対値の総和を*pSumに格納し、差の絶対値がthより小さい要素の数を返すカーネル
+*/
+typedef std::size_t (*SadCountKernel)(float const * a, float const * b, std::size_t n, float th, double* pSum);
+
+
+/**
+2組の列(a, b), (c, d)について、|a[i] - b[i]|の総和を*pSum1に、
+|c[i] - d[i]|の総和を*pSum2に、1回の走査で格納するカーネル。総和はdoubleで取ります。
+*/
+typedef void (*FusedStatsKernel)(float const * a, float const * b, float const * c, float const * d, std::size_t n,
+                                 double* pSum1, double* pSum2);
+
+
+/**
+| |a[i] - b[i]| - center | の総和を返すカーネル。centerとの差と総和はdoubleで取ります。
+*/
+typedef double (*AbsDevKernel)(float const * a, float const * b, std::size_t n, double center);
+
+
+/**
+(|a[i] - b[i]| - center)^2 の総和を返すカーネル。centerとの差と総和はdoubleで取ります。
+E[x^2] - E[x]^2 と違って桁落ちしないので、平均を求めてからの2回目の走査で分散を求めるのに使います。
+*/
+typedef double (*SqDevKernel)(float const * a, float const * b, std::size_t n, double center);
+
+
+/**
+8ビット整数の列a, bについて、a[i]とb[i]の差の絶対値の総和を返すカーネル
+*/
+typedef std::uint64_t (*SadU8Kernel)(std::uint8_t const * a, std::uint8_t const * b, std::size_t n);
+
+
+struct Kernels
+{
+    Isa isa;
+    SadKernel sad;
+    SadCountKernel sad_count;
+    FusedStatsKernel fused_stats;
+    AbsDevKernel abs_dev;
+    SqDevKernel sq_dev;
+    SadU8Kernel sad_u8;
+
+    // 1辺が32, 64, 128画素のとき(要素数はその3倍)に使う、要素数を固定したsadとsad_u8
+    SadKernel sad_fixed[3];
+    SadU8Kernel sad_u8_fixed[3];
+};
+
+
+namespace scalar {
+
+inline double sad(float const * a, float const * b, std::size_t n)
+{
+    double sum = 0;
+    for(std::size_t i = 0; i < n; ++i)
+        sum += std::abs(a[i] - b[i]);
+
+    return sum;
+}
+
+
+inline std::size_t sad_count(float const * a, float const * b, std::size_t n, float th, double* pSum)
+{
+    double sum = 0;
+    std::size_t cnt = 0;
+    for(std::size_t i = 0; i < n; ++i){
+        const float v = std::abs(a[i] - b[i]);
+        sum += v;
+        if(v < th) ++cnt;
+    }
+
+    *pSum = sum;
+    return cnt;
+}
+
+
+inline void fused_stats(float const * a, float const * b, float const * c, float const * d, std::size_t n,
+                        double* pSum1, double* pSum2)
+{
+    double sum1 = 0, sum2 = 0;
+    for(std::size_t i = 0; i < n; ++i){
+        sum1 += std::abs(a[i] - b[i]);
+        sum2 += std::abs(c[i] - d[i]);
+    }
+
+    *pSum1 = sum1;
+    *pSum2 = sum2;
+}
+
+
+inline double abs_dev(float const * a, float const * b, std::size_t n, double center)
+{
+    double sum = 0;
+    for(std::size_t i = 0; i < n; ++i)
+        sum += std::abs(std::abs(a[i] - b[i]) - center);
+
+    return sum;
+}
+
+
+inline double sq_dev(float const * a, float const * b, std::size_t n, double center)
+{
+    double sum = 0;
+    for(std::size_t i = 0; i < n; ++i){
+        const double x = std::abs(a[i] - b[i]) - center;
+        sum += x * x;
+    }
+
+    return sum;
+}
+
+
+inline std::uint64_t sad_u8(std::uint8_t const * a, std::uint8_t const * b, std::size_t n)
+{
+    std::uint64_t sum = 0;
+    for(std::size_t i = 0; i < n; ++i)
+        sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+
+    return sum;
+}
+
+
+/**
+要素数がNに固定されたsad。ループの回数がコンパイル時に決まるので、展開されます。
+nは無視されます。
+*/
+template <std::size_t N>
+inline double sad_fixed(float const * a, float const * b, std::size_t /*n*/)
+{
+    return sad(a, b, N);
+}
+
+
+template <std::size_t N>
+inline std::uint64_t sad_u8_fixed(std::uint8_t const * a, std::uint8_t const * b, std::size_t /*n*/)
+{
+    return sad_u8(a, b, N);
+}
+
+
+inline void set_fixed(Kernels& ks)
+{
+    ks.sad_fixed[0] = &sad_fixed<32 * 3>;
+    ks.sad_fixed[1] = &sad_fixed<64 * 3>;
+    ks.sad_fixed[2] = &sad_fixed<128 * 3>;
+    ks.sad_u8_fixed[0] = &sad_u8_fixed<32 * 3>;
+    ks.sad_u8_fixed[1] = &sad_u8_fixed<64 * 3>;
+    ks.sad_u8_fixed[2] = &sad_u8_fixed<128 * 3>;
+}
+
+} // namespace scalar
+
+
+#ifdef PROCON_SIMD_X86
+namespace sse2 {
+
+PROCON_SIMD_TARGET("sse2")
+inline __m128 absdiff(__m128 a, __m128 b)
+{
+    return _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(a, b));
+}
+
+
+PROCON_SIMD_TARGET("sse2")
+inline double hsum(__m128 v)
+{
+    alignas(16) float buf[4];
+    _mm_store_ps(buf, v);
+    return static_cast<double>(buf[0]) + buf[1] + buf[2] + buf[3];
+}
+
+
+/// floatの4要素を、doubleの2要素ずつ*pLoと*pHiに分けます
+PROCON_SIMD_TARGET("sse2")
+inline void split_pd(__m128 v, __m128d* pLo, __m128d* pHi)
+{
+    *pLo = _mm_cvtps_pd(v);
+    *pHi = _mm_cvtps_pd(_mm_movehl_ps(v, v));
+}
+
+
+PROCON_SIMD_TARGET("sse2")
+inline double hsum_pd(__m128d v)
+{
+    alignas(16) double buf[2];
+    _mm_store_pd(buf, v);
+    return buf[0] + buf[1];
+}
+
+
+PROCON_SIMD_TARGET("sse2")
+inline double sad(float const * a, float const * b, std::size_t n)
+{
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    std::size_t i = 0;
+    for(; i + 8 <= n; i += 8){
+        acc0 = _mm_add_ps(acc0, absdiff(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, absdiff(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+
+    return hsum(_mm_add_ps(acc0, acc1)) + scalar::sad(a + i, b + i, n - i);
+}
+
+
+PROCON_SIMD_TARGET("sse2")
+inline std::size_t sad_count(float const * a, float const * b, std::size_t n, float th, double* pSum)
+{
+    const __m128 vth = _mm_set1_ps(th);
+    __m128 acc = _mm_setzero_ps();
+    std::size_t cnt = 0;
+    std::size_t i = 0;
+    for(; i + 4 <= n; i += 4){
+        const __m128 d = absdiff(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        acc = _mm_add_ps(acc, d);
+        cnt += std::bitset<4>(_mm_movemask_ps(_mm_cmplt_ps(d, vth))).count();
+    }
+
+    double tail;
+    cnt += scalar::sad_count(a + i, b + i, n - i, th, &tail);
+    *pSum = hsum(acc) + tail;
+    return cnt;
+}
+
+
+PROCON_SIMD_TARGET("sse2")
+inline void fused_stats(float const * a, float const * b, float const * c, float const * d, std::size_t n,
+                        double* pSum1, double* pSum2)
+{
+    __m128d acc1 = _mm_setzero_pd(), acc2 = _mm_setzero_pd();
+    std::size_t i = 0;
+    for(; i + 4 <= n; i += 4){
+        __m128d lo, hi;
+        split_pd(absdiff(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)), &lo, &hi);
+        acc1 = _mm_add_pd(acc1, _mm_add_pd(lo, hi));
+        split_pd(absdiff(_mm_loadu_ps(c + i), _mm_loadu_ps(d + i)), &lo, &hi);
+        acc2 = _mm_add_pd(acc2, _mm_add_pd(lo, hi));
+    }
+
+    scalar::fused_stats(a + i, b + i, c + i, d + i, n - i, pSum1, pSum2);
+    *pSum1 += hsum_pd(acc1);
+    *pSum2 += hsum_pd(acc2);
+}
+
+
+PROCON_SIMD_TARGET("sse2")
+inline double abs_dev(float const * a, float const * b, std::size_t n, double center)
+{
+    const __m128d vc = _mm_set1_pd(center), sign = _mm_set1_pd(-0.0);
+    __m128d acc = _mm_setzero_pd();
+    std::size_t i = 0;
+    for(; i + 4 <= n; i += 4){
+        __m128d lo, hi;
+        split_pd(absdiff(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)), &lo, &hi);
+        acc = _mm_add_pd(acc, _mm_andnot_pd(sign, _mm_sub_pd(lo, vc)));
+        acc = _mm_add_pd(acc, _mm_andnot_pd(sign, _mm_sub_pd(hi, vc)));
+    }
+
+    return hsum_pd(acc) + scalar::abs_dev(a + i, b + i, n - i, center);
+}
+
+
+PROCON_SIMD_TARGET("sse2")
+inline double sq_dev(float const * a, float const * b, std::size_t n, double center)
+{
+    const __m128d vc = _mm_set1_pd(center);
+    __m128d acc = _mm_setzero_pd();
+    std::size_t i = 0;
+    for(; i + 4 <= n; i += 4){
+        __m128d lo, hi;
+        split_pd(absdiff(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)), &lo, &hi);
+        lo = _mm_sub_pd(lo, vc);
+        hi = _mm_sub_pd(hi, vc);
+        acc = _mm_add_pd(acc, _mm_add_pd(_mm_mul_pd(lo, lo), _mm_mul_pd(hi, hi)));
+    }
+
+    return hsum_pd(acc) + scalar::sq_dev(a + i, b + i, n - i, center);
+}
+
+
+PROCON_SIMD_TARGET("sse2")
+inline std::uint64_t sad_u8(std::uint8_t const * a, std::uint8_t const * b, std::size_t n)
+{
+    // psadbwは16バイトごとに、8バイトずつの差の絶対値の和を2つの64ビット整数として返す
+    __m128i acc = _mm_setzero_si128();
+    std::size_t i = 0;
+    for(; i + 16 <= n; i += 16){
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<__m128i const *>(a + i));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<__m128i const *>(b + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+    }
+
+    alignas(16) std::uint64_t buf[2];
+    _mm_store_si128(reinterpret_cast<__m128i*>(buf), acc);
+    return buf[0] + buf[1] + scalar::sad_u8(a + i, b + i, n - i);
+}
+
+
+template <std::size_t N>
+PROCON_SIMD_TARGET("sse2")
+inline double sad_fixed(float const * a, float const * b, std::size_t /*n*/)
+{
+    return sad(a, b, N);
+}
+
+
+template <std::size_t N>
+PROCON_SIMD_TARGET("sse2")
+inline std::uint64_t sad_u8_fixed(std::uint8_t const * a, std::uint8_t const * b, std::size_t /*n*/)
+{
+    return sad_u8(a, b, N);
+}
+
+
+inline void set_fixed(Kernels& ks)
+{
+    ks.sad_fixed[0] = &sad_fixed<32 * 3>;
+    ks.sad_fixed[1] = &sad_fixed<64 * 3>;
+    ks.sad_fixed[2] = &sad_fixed<128 * 3>;
+    ks.sad_u8_fixed[0] = &sad_u8_fixed<32 * 3>;
+    ks.sad_u8_fixed[1] = &sad_u8_fixed<64 * 3>;
+    ks.sad_u8_fixed[2] = &sad_u8_fixed<128 * 3>;
+}
+
+} // namespace sse2
+
+
+namespace avx2 {
+
+PROCON_SIMD_TARGET("avx2")
+inline __m256 absdiff(__m256 a, __m256 b)
+{
+    return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), _mm256_sub_ps(a, b));
+}
+
+
+PROCON_SIMD_TARGET("avx2")
+inline double hsum(__m256 v)
+{
+    const __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    alignas(16) float buf[4];
+    _mm_store_ps(buf, s);
+    return static_cast<double>(buf[0]) + buf[1] + buf[2] + buf[3];
+}
+
+
+/// floatの8要素を、doubleの4要素ずつ*pLoと*pHiに分けます
+PROCON_SIMD_TARGET("avx2")
+inline void split_pd(__m256 v, __m256d* pLo, __m256d* pHi)
+{
+    *pLo = _mm256_cvtps_pd(_mm256_castps256_ps128(v));
+    *pHi = _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1));
+}
+
+
+PROCON_SIMD_TARGET("avx2")
+inline double hsum_pd(__m256d v)
+{
+    alignas(32) double buf[4];
+    _mm256_store_pd(buf, v);
+    return buf[0] + buf[1] + buf[2] + buf[3];
+}
+
+
+PROCON_SIMD_TARGET("avx2")
+inline double sad(float const * a, float const * b, std::size_t n)
+{
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    std::size_t i = 0;
+    for(; i + 16 <= n; i += 16){
+        acc0 = _mm256_add_ps(acc0, absdiff(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+        acc1 = _mm256_add_ps(acc1, absdiff(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+    }
+
+    return hsum(_mm256_add_ps(acc0, acc1)) + scalar::sad(a + i, b + i, n - i);
+}
+
+
+PROCON_SIMD_TARGET("avx2")
+inline std::size_t sad_count(float const * a, float const * b, std::size_t n, float th, double* pSum)
+{
+    const __m256 vth = _mm256_set1_ps(th);
+    __m256 acc = _mm256_setzero_ps();
+    std::size_t cnt = 0;
+    std::size_t i = 0;
+    for(; i + 8 <= n; i += 8){
+        const __m256 d = absdiff(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc = _mm256_add_ps(acc, d);
+        cnt += std::bitset<8>(_mm256_movemask_ps(_mm256_cmp_ps(d, vth, _CMP_LT_OQ))).count();
+    }
+
+    double tail;
+    cnt += scalar::sad_count(a + i, b + i, n - i, th, &tail);
+    *pSum = hsum(acc) + tail;
+    return cnt;
+}
+
+
+PROCON_SIMD_TARGET("avx2")
+inline void fused_stats(float const * a, float const * b, float const * c, float const * d, std::size_t n,
+                        double* pSum1, double* pSum2)
+{
+    __m256d acc1 = _mm256_setzero_pd(), acc2 = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for(; i + 8 <= n; i += 8){
+        __m256d lo, hi;
+        split_pd(absdiff(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)), &lo, &hi);
+        acc1 = _mm256_add_pd(acc1, _mm256_add_pd(lo, hi));
+        split_pd(absdiff(_mm256_loadu_ps(c + i), _mm256_loadu_ps(d + i)), &lo, &hi);
+        acc2 = _mm256_add_pd(acc2, _mm256_add_pd(lo, hi));
+    }
+
+    scalar::fused_stats(a + i, b + i, c + i, d + i, n - i, pSum1, pSum2);
+    *pSum1 += hsum_pd(acc1);
+    *pSum2 += hsum_pd(acc2);
+}
+
+
+PROCON_SIMD_TARGET("avx2")
+inline double abs_dev(float const * a, float const * b, std::size_t n, double center)
+{
+    const __m256d vc = _mm256_set1_pd(center), sign = _mm256_set1_pd(-0.0);
+    __m256d acc = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for(; i + 8 <= n; i += 8){
+        __m256d lo, hi;
+        split_pd(absdiff(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)), &lo, &hi);
+        acc = _mm256_add_pd(acc, _mm256_andnot_pd(sign, _mm256_sub_pd(lo, vc)));
+        acc = _mm256_add_pd(acc, _mm256_andnot_pd(sign, _mm256_sub_pd(hi, vc)));
+    }
+
+    return hsum_pd(acc) + scalar::abs_dev(a + i, b + i, n - i, center);
+}
+
+
+PROCON_SIMD_TARGET("avx2")
+inline double sq_dev(float const * a, float const * b, std::size_t n, double center)
+{
+    const __m256d vc = _mm256_set1_pd(center);
+    __m256d acc = _mm256_setzero_pd();
+    std::size_t i = 0;
+    for(; i + 8 <= n; i += 8){
+        __m256d lo, hi;
+        split_pd(absdiff(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)), &lo, &hi);
+        lo = _mm256_sub_pd(lo, vc);
+        hi = _mm256_sub_pd(hi, vc);
+        acc = _mm256_add_pd(acc, _mm256_add_pd(_mm256_mul_pd(lo, lo), _mm256_mul_pd(hi, hi)));
+    }
+
+    return hsum_pd(acc) + scalar::sq_dev(a + i, b + i, n - i, center);
+}
+
+
+PROCON_SIMD_TARGET("avx2")
+inline std::uint64_t sad_u8(std::uint8_t const * a, std::uint8_t const * b, std::size_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    std::size_t i = 0;
+    for(; i + 32 <= n; i += 32){
+        const __m256i va = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(a + i));
+        const __m256i vb = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(b + i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(va, vb));
+    }
+
+    alignas(32) std::uint64_t buf[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(buf), acc);
+    return buf[0] + buf[1] + buf[2] + buf[3] + sse2::sad_u8(a + i, b + i, n - i);
+}
+
+
+template <std::size_t N>
+PROCON_SIMD_TARGET("avx2")
+inline double sad_fixed(float const * a, float const * b, std::size_t /*n*/)
+{
+    return sad(a, b, N);
+}
+
+
+template <std::size_t N>
+PROCON_SIMD_TARGET("avx2")
+inline std::uint64_t sad_u8_fixed(std::uint8_t const * a, std::uint8_t const * b, std::size_t /*n*/)
+{
+    return sad_u8(a, b, N);
+}
+
+
+inline void set_fixed(Kernels& ks)
+{
+    ks.sad_fixed[0] = &sad_fixed<32 * 3>;
+    ks.sad_fixed[1] = &sad_fixed<64 * 3>;
+    ks.sad_fixed[2] = &sad_fixed<128 * 3>;
+    ks.sad_u8_fixed[0] = &sad_u8_fixed<32 * 3>;
+    ks.sad_u8_fixed[1] = &sad_u8_fixed<64 * 3>;
+    ks.sad_u8_fixed[2] = &sad_u8_fixed<128 * 3>;
+}
+
+} // namespace avx2
+
+
+namespace avx512 {
+
+PROCON_SIMD_TARGET("avx512f")
+inline double hsum(__m512 v)
+{
+    alignas(64) float buf[16];
+    _mm512_store_ps(buf, v);
+
+    double sum = 0;
+    for(float e: buf)
+        sum += e;
+
+    return sum;
+}
+
+
+PROCON_SIMD_TARGET("avx512f")
+inline double sad(float const * a, float const * b, std::size_t n)
+{
+    __m512 acc = _mm512_setzero_ps();
+    std::size_t i = 0;
+    for(; i + 16 <= n; i += 16)
+        acc = _mm512_add_ps(acc, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i))));
+
+    return hsum(acc) + scalar::sad(a + i, b + i, n - i);
+}
+
+
+PROCON_SIMD_TARGET("avx512f")
+inline std::size_t sad_count(float const * a, float const * b, std::size_t n, float th, double* pSum)
+{
+    const __m512 vth = _mm512_set1_ps(th);
+    __m512 acc = _mm512_setzero_ps();
+    std::size_t cnt = 0;
+    std::size_t i = 0;
+    for(; i + 16 <= n; i += 16){
+        const __m512 d = _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+        acc = _mm512_add_ps(acc, d);
+        cnt += std::bitset<16>(_mm512_cmp_ps_mask(d, vth, _CMP_LT_OQ)).count();
+    }
+
+    double tail;
+    cnt += scalar::sad_count(a + i, b + i, n - i, th, &tail);
+    *pSum = hsum(acc) + tail;
+    return cnt;
+}
+
+
+template <std::size_t N>
+PROCON_SIMD_TARGET("avx512f")
+inline double sad_fixed(float const * a, float const * b, std::size_t /*n*/)
+{
+    return sad(a, b, N);
+}
+
+
+inline void set_fixed(Kernels& ks)
+{
+    ks.sad_fixed[0] = &sad_fixed<32 * 3>;
+    ks.sad_fixed[1] = &sad_fixed<64 * 3>;
+    ks.sad_fixed[2] = &sad_fixed<128 * 3>;
+    ks.sad_u8_fixed[0] = &avx2::sad_u8_fixed<32 * 3>;
+    ks.sad_u8_fixed[1] = &avx2::sad_u8_fixed<64 * 3>;
+    ks.sad_u8_fixed[2] = &avx2::sad_u8_fixed<128 * 3>;
+}
+
+} // namespace avx512
+#endif // PROCON_SIMD_X86
+
+
+/**
+このCPUで使える、もっとも幅の広い命令セットを返します
+*/
+inline Isa detect_isa()
+{
+#if !defined(PROCON_SIMD_X86)
+    return Isa::scalar;
+#elif defined(__GNUC__) || defined(__clang__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f"))
+        return Isa::avx512;
+    if(__builtin_cpu_supports("avx2"))
+        return Isa::avx2;
+    if(__builtin_cpu_supports("sse2"))
+        return Isa::sse2;
+    return Isa::scalar;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    const bool sse2 = (info[3] & (1 << 26)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+
+    if(maxLeaf >= 7 && (xcr0 & 0x6) == 0x6){
+        __cpuidex(info, 7, 0);
+        if((info[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6)
+            return Isa::avx512;
+        if(info[1] & (1 << 5))
+            return Isa::avx2;
+    }
+
+    return sse2 ? Isa::sse2 : Isa::scalar;
+#else
+    return Isa::scalar;
+#endif
+}
+
+
+/**
+命令セットisaのカーネル群を返します。
+このCPUで使えない命令セットを指定してはいけません。
+*/
+inline Kernels kernels_for(Isa isa)
+{
+    Kernels ks;
+    switch(isa){
+#ifdef PROCON_SIMD_X86
+        // 8ビット整数のpsadbwはAVX-512BWが必要なので、AVX-512FではAVX2のカーネルを使う
+        // doubleで総和を取るカーネルも、AVX2のもので十分なのでそれを使う
+        case Isa::avx512: ks = Kernels{isa, &avx512::sad, &avx512::sad_count, &avx2::fused_stats, &avx2::abs_dev, &avx2::sq_dev, &avx2::sad_u8, {}, {}};
+                          avx512::set_fixed(ks);
+                          break;
+        case Isa::avx2:   ks = Kernels{isa, &avx2::sad, &avx2::sad_count, &avx2::fused_stats, &avx2::abs_dev, &avx2::sq_dev, &avx2::sad_u8, {}, {}};
+                          avx2::set_fixed(ks);
+                          break;
+        case Isa::sse2:   ks = Kernels{isa, &sse2::sad, &sse2::sad_count, &sse2::fused_stats, &sse2::abs_dev, &sse2::sq_dev, &sse2::sad_u8, {}, {}};
+                          sse2::set_fixed(ks);
+                          break;
+#endif
+        default:          ks = Kernels{Isa::scalar, &scalar::sad, &scalar::sad_count, &scalar::fused_stats, &scalar::abs_dev, &scalar::sq_dev, &scalar::sad_u8, {}, {}};
+                          scalar::set_fixed(ks);
+                          break;
+    }
+
+    return ks;
+}
+
+
+/**
+要素数nが固定長のカーネルの対象なら、その添字(0, 1, 2)を返し、そうでなければ-1を返します
+*/
+inline int fixed_slot(std::size_t n)
+{
+    switch(n){
+        case 32 * 3:  return 0;
+        case 64 * 3:  return 1;
+        case 128 * 3: return 2;
+        default:      return -1;
+    }
+}
+
+
+/**
+実行時に選ばれたカーネル群を返します
+*/
+inline Kernels const & kernels()
+{
+    static const Kernels ks = kernels_for(detect_isa());
+    return ks;
+}
+
+
+/**
+nが1辺32, 64, 128画素の辺の要素数のときは、要素数を固定したカーネルを使います
+*/
+inline double sad(float const * a, float const * b, std::size_t n)
+{
+    Kernels const & ks = kernels();
+    const int slot = fixed_slot(n);
+    return slot < 0 ? ks.sad(a, b, n) : ks.sad_fixed[slot](a, b, n);
+}
+
+
+inline std::uint64_t sad(std::uint8_t const * a, std::uint8_t const * b, std::size_t n)
+{
+    Kernels const & ks = kernels();
+    const int slot = fixed_slot(n);
+    return slot < 0 ? ks.sad_u8(a, b, n) : ks.sad_u8_fixed[slot](a, b, n);
+}
+
+
+inline std::size_t sad_count(float const * a, float const * b, std::size_t n, float th, double* pSum)
+{
+    return kernels().sad_count(a, b, n, th, pSum);
+}
+
+
+
+inline void fused_stats(float const * a, float const * b, float const * c, float const * d, std::size_t n,
+                        double* pSum1, double* pSum2)
+{
+    kernels().fused_stats(a, b, c, d, n, pSum1, pSum2);
+}
+
+
+inline double abs_dev(float const * a, float const * b, std::size_t n, double center)
+{
+    return kernels().abs_dev(a, b, n, center);
+}
+
+
+inline double sq_dev(float const * a, float const * b, std::size_t n, double center)
+{
+    return kernels().sq_dev(a, b, n, center);
+}
+
+}}
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+namespace procon { namespace telemetry {
+
+/**
+探索の計数値です。
+ソルバーはスレッドごとにこれを数え、最後にTelemetry::add()でまとめて加えます。
+*/
+struct Counters
+{
+    Counters()
+    : expanded(0), generated(0), pruned(0), duplicates(0), comparisons(0), generations(0), maxBeam(0),
+      best(std::numeric_limits<double>::infinity()) {}
+
+
+    std::size_t expanded;       // 展開した状態の数
+    std::size_t generated;      // 作った子の数
+    std::size_t pruned;         // 次の世代に残らなかった子の数(duplicatesは含まない)
+    std::size_t duplicates;     // 同じ状態として捨てた子の数
+    std::size_t comparisons;    // 比較関数を呼び出した回数
+    std::size_t generations;    // 世代(反復)の数
+    std::size_t maxBeam;        // 1世代に残した状態の数の最大値
+    double best;                // 最良の評価値
+
+
+    /// 回数は足し合わせ、maxBeamは最大値を、bestは最小値を取ります
+    Counters& operator+=(Counters const & rhs)
+    {
+        expanded += rhs.expanded;
+        generated += rhs.generated;
+        pruned += rhs.pruned;
+        duplicates += rhs.duplicates;
+        comparisons += rhs.comparisons;
+        generations += rhs.generations;
+        maxBeam = std::max(maxBeam, rhs.maxBeam);
+        best = std::min(best, rhs.best);
+        return *this;
+    }
+};
+
+
+/**
+1つの段階の記録
+*/
+struct StageRecord
+{
+    std::string name;
+    Counters counters;
+    std::chrono::nanoseconds elapsed;   // 段階にかかった時間
+};
+
+
+/**
+ソルバーの探索の記録です。
+
+ソルバーは、Telemetry*を受け取り、それがnullptrでなければ、段階ごとに計数値と時間を記録します。
+nullptrのときは何もしないので、記録しない場合の負担はポインタの比較だけです。
+
+記録した段階はstages()で読み出せます。
+sinkを指定した場合は、段階を終えるたびにその記録がsinkに渡されます。
+add()は複数のスレッドから同時に呼び出せますが、begin_stage()とend_stage()は
+ソルバーを呼び出したスレッドから呼び出します。
+*/
+class Telemetry
+{
+  public:
+    typedef std::function<void(StageRecord const &)> Sink;
+
+
+    Telemetry() : _open(false) {}
+
+
+    explicit Telemetry(Sink sink) : _sink(std::move(sink)), _open(false) {}
+
+
+    /**
+    nameという段階を始めます。
+    前の段階を終えていなければ、先に終えます。
+    */
+    void begin_stage(std::string name)
+    {
+        if(_open)
+            end_stage();
+
+        std::lock_guard<std::mutex> lock(_m);
+        _current.name = std::move(name);
+        _current.counters = Counters();
+        _start = std::chrono::steady_clock::now();
+        _open = true;
+    }
+
+
+    /// 現在の段階を終え、sinkがあれば記録を渡します
+    void end_stage()
+    {
+        if(!_open)
+            return;
+
+        StageRecord rec;
+        {
+            std::lock_guard<std::mutex> lock(_m);
+            _current.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start);
+            _stages.push_back(_current);
+            rec = _current;
+            _open = false;
+        }
+
+        if(_sink)
+            _sink(rec);
+    }
+
+
+    /// 現在の段階にcを加えます
+    void add(Counters const & c)
+    {
+        std::lock_guard<std::mutex> lock(_m);
+        _current.counters += c;
+    }
+
+
+    std::vector<StageRecord> const & stages() const { return _stages; }
+
+
+    /// すべての段階の計数値の合計
+    Counters total() const
+    {
+        Counters dst;
+        for(auto& e: _stages)
+            dst += e.counters;
+
+        return dst;
+    }
+
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(_m);
+        _stages.clear();
+        _open = false;
+    }
+
+
+  private:
+    std::mutex _m;
+    Sink _sink;
+    std::vector<StageRecord> _stages;
+    StageRecord _current;
+    std::chrono::steady_clock::time_point _start;
+    bool _open;
+};
+
+
+/**
+pTelemetryがnullptrでなければ、cを現在の段階に加えます
+*/
+inline void add(Telemetry* pTelemetry, Counters const & c)
+{
+    if(pTelemetry)
+        pTelemetry->add(c);
+}
+
+
+/**
+pTelemetryがnullptrでなければ、nameという段階を始めます
+*/
+inline void begin_stage(Telemetry* pTelemetry, char const * name)
+{
+    if(pTelemetry)
+        pTelemetry->begin_stage(name);
+}
+
+
+/**
+pTelemetryがnullptrでなければ、現在の段階を終えます
+*/
+inline void end_stage(Telemetry* pTelemetry)
+{
+    if(pTelemetry)
+        pTelemetry->end_stage();
+}
+
+
+/**
+段階の記録を、1段階1行でosに書き出すsinkを返します。
+
+Example:
+------------
+telemetry::Telemetry tm(telemetry::stream_sink(std::cerr));
+auto idxs = bfs_guess::bfs_guess(problem, f, config);    // config.pTelemetry = &tm
+------------
+*/
+inline Telemetry::Sink stream_sink(std::ostream& os)
+{
+    return [&os](StageRecord const & r){
+        auto const & c = r.counters;
+        os << r.name
+           << ": expanded=" << c.expanded
+           << " generated=" << c.generated
+           << " pruned=" << c.pruned
+           << " duplicates=" << c.duplicates
+           << " comparisons=" << c.comparisons
+           << " generations=" << c.generations
+           << " maxBeam=" << c.maxBeam
+           << " best=" << c.best
+           << " ms=" << std::chrono::duration_cast<std::chrono::milliseconds>(r.elapsed).count()
+           << std::endl;
+    };
+}
+
+}}
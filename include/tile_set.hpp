@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include "../../utils/include/types.hpp"
+#include "edge_storage.hpp"
+
+
+namespace procon { namespace guess {
+
+/**
+画像片の集合です。
+
+画像片を序数で管理し、追加、削除、存在確認はすべてO(1)です。
+要素は1本の配列に詰めて保持するので、走査は連続したメモリを先頭から読むだけで、
+data()をそのままevaluate_batch()に渡せます。
+削除は末尾の要素との入れ替えで行うので、要素の順序は保たれません。
+
+中身は2本の配列だけなので、試行の前にコピーを取っておき、後で代入して戻すのも安価です。
+代入先が既に同じ大きさの領域を持っていれば、メモリの確保も起きません。
+*/
+class TileSet
+{
+  public:
+    TileSet() : _divX(0) {}
+
+
+    /**
+    div_x * div_yの問題の画像片の集合を作ります。
+    fullがtrueならすべての画像片を含み、falseなら空の集合です。
+    */
+    TileSet(std::size_t divX, std::size_t divY, bool full)
+    : _divX(divX), _pos(divX * divY, static_cast<std::size_t>(npos))
+    {
+        _ids.reserve(divX * divY);
+
+        if(full)
+            for(std::size_t i = 0; i < divX * divY; ++i){
+                _pos[i] = i;
+                _ids.emplace_back(i / divX, i % divX);
+            }
+    }
+
+
+    bool contains(utils::ImageID const & id) const
+    {
+        return _pos[tile_ordinal(id, _divX)] != npos;
+    }
+
+
+    void insert(utils::ImageID const & id)
+    {
+        const std::size_t ord = tile_ordinal(id, _divX);
+        if(_pos[ord] != npos)
+            return;
+
+        _pos[ord] = _ids.size();
+        _ids.push_back(id);
+    }
+
+
+    void erase(utils::ImageID const & id)
+    {
+        const std::size_t ord = tile_ordinal(id, _divX);
+        const std::size_t p = _pos[ord];
+        if(p == npos)
+            return;
+
+        const utils::ImageID last = _ids.back();
+        _ids[p] = last;
+        _pos[tile_ordinal(last, _divX)] = p;
+        _ids.pop_back();
+        _pos[ord] = npos;
+    }
+
+
+    std::size_t size() const { return _ids.size(); }
+    bool empty() const { return _ids.empty(); }
+
+    utils::ImageID const * data() const { return _ids.data(); }
+    utils::ImageID const * begin() const { return _ids.data(); }
+    utils::ImageID const * end() const { return _ids.data() + _ids.size(); }
+
+
+  private:
+    static constexpr std::size_t npos = std::numeric_limits<std::size_t>::max();
+
+    std::size_t _divX;
+    std::vector<utils::ImageID> _ids;       // 要素
+    std::vector<std::size_t> _pos;          // 序数 -> _idsの中での位置(含まれていなければnpos)
+};
+
+}}